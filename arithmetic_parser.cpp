@@ -14,12 +14,18 @@
 
 #include "arithmetic_parser.hpp"
 
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cstdlib>
 #include <cstdio>
-#include <deque>
-#include <queue>
-#include <stack>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
 
 
 #ifndef PARSER_NAME
@@ -30,8 +36,6 @@
 #define PARSER_LOG(msg, ...) PARSER_PRINTF(PARSER_NAME": " msg "\n", ##__VA_ARGS__)
 #define PARSER_ASSERT(condition) assert(condition);
 
-using operand_t = int;
-
 enum Precedence : char {
     // https://en.cppreference.com/w/c/language/operator_precedence
     // https://en.cppreference.com/w/cpp/language/operator_precedence
@@ -48,370 +52,953 @@ enum Precedence : char {
     PRECEDENCE_BIT_OR,
     PRECEDENCE_LOGICAL_AND,
     PRECEDENCE_LOGICAL_OR,
-};
 
-enum Operator: short {
-    // parenthesis
-    OPER_PAREN_LEFT    = '(',               // (
-    OPER_PAREN_RIGHT   = ')',               // )
-    // 1: multiplication, division, remainder
-    OPER_MULTIPLY      = '*',               // *
-    OPER_DIVIDE        = '/',               // /
-    OPER_REMINDER      = '%',               // %
-    // 2: addition, subtraction
-    OPER_ADD           = '+',               // +
-    OPER_SUBTRACT      = '-',               // -
-    // 3: bitwise left and right
-    OPER_BITWISE_LEFT  = '<' | ('<' << 8),  // <<
-    OPER_BITWISE_RIGHT = '>' | ('>' << 8),  // >>
-    // 4: relational
-    OPER_LESSER        = '<',               // <
-    OPER_GREATER       = '>',               // >
-    OPER_LESSER_EQ     = '<' | ('=' << 8),  // <=
-    OPER_GREATER_EQ    = '>' | ('=' << 8),  // >=
-    // 5: equality
-    OPER_EQ_EQ         = '=' | ('=' << 8),  // ==
-    OPER_NOT_EQ        = '!' | ('=' << 8),  // !=
-    // 6, 7, 8: bitwise
-    OPER_BIT_OR        = '|',               // |
-    OPER_BIT_XOR       = '^',               // ^
-    OPER_BIT_AND       = '&',               // &
-    // 9, 10: logical operators
-    OPER_LOGICAL_AND   = '&' | ('&' << 8),  // &&
-    OPER_LOGICAL_OR    = '|' | ('|' << 8),  // ||
-    // (not valid by themselves, only used when tokenizing)
-    OPER_EQ            = '=',               // =
-    OPER_NOT           = '!',               // !
+    PRECEDENCE_LOWEST,
 };
 
-static unsigned char GetOperatorPrecedence(short oper) {
-    switch (oper) {
-    case OPER_MULTIPLY:         return PRECEDENCE_MULT_DIV;
-    case OPER_DIVIDE:           return PRECEDENCE_MULT_DIV;
-    case OPER_REMINDER:         return PRECEDENCE_MULT_DIV;
-    case OPER_ADD:              return PRECEDENCE_ADD_SUBT;
-    case OPER_SUBTRACT:         return PRECEDENCE_ADD_SUBT;
-    case OPER_BITWISE_LEFT:     return PRECEDENCE_BITSHIFT;
-    case OPER_BITWISE_RIGHT:    return PRECEDENCE_BITSHIFT;
-    case OPER_LESSER:           return PRECEDENCE_RELATIONAL;
-    case OPER_GREATER:          return PRECEDENCE_RELATIONAL;
-    case OPER_LESSER_EQ:        return PRECEDENCE_RELATIONAL;
-    case OPER_GREATER_EQ:       return PRECEDENCE_RELATIONAL;
-    case OPER_BIT_OR:           return PRECEDENCE_BIT_OR;
-    case OPER_BIT_XOR:          return PRECEDENCE_BIT_XOR;
-    case OPER_BIT_AND:          return PRECEDENCE_BIT_AND;
-    case OPER_LOGICAL_OR:       return PRECEDENCE_LOGICAL_OR;
-    case OPER_LOGICAL_AND:      return PRECEDENCE_LOGICAL_AND;
-    case OPER_EQ_EQ:            return PRECEDENCE_EQUALITY;
-    case OPER_NOT_EQ:           return PRECEDENCE_EQUALITY;
+static unsigned char GetOpcodePrecedence(ExpressionOpcode op) {
+    switch (op) {
+    case EXPR_MULTIPLY:         return PRECEDENCE_MULT_DIV;
+    case EXPR_DIVIDE:           return PRECEDENCE_MULT_DIV;
+    case EXPR_REMAINDER:        return PRECEDENCE_MULT_DIV;
+    case EXPR_ADD:              return PRECEDENCE_ADD_SUBT;
+    case EXPR_SUBTRACT:         return PRECEDENCE_ADD_SUBT;
+    case EXPR_BITWISE_LEFT:     return PRECEDENCE_BITSHIFT;
+    case EXPR_BITWISE_RIGHT:    return PRECEDENCE_BITSHIFT;
+    case EXPR_LESSER:           return PRECEDENCE_RELATIONAL;
+    case EXPR_GREATER:          return PRECEDENCE_RELATIONAL;
+    case EXPR_LESSER_EQ:        return PRECEDENCE_RELATIONAL;
+    case EXPR_GREATER_EQ:       return PRECEDENCE_RELATIONAL;
+    case EXPR_EQ_EQ:            return PRECEDENCE_EQUALITY;
+    case EXPR_NOT_EQ:           return PRECEDENCE_EQUALITY;
+    case EXPR_BIT_AND:          return PRECEDENCE_BIT_AND;
+    case EXPR_BIT_XOR:          return PRECEDENCE_BIT_XOR;
+    case EXPR_BIT_OR:           return PRECEDENCE_BIT_OR;
+    case EXPR_LOGICAL_AND:      return PRECEDENCE_LOGICAL_AND;
+    case EXPR_LOGICAL_OR:       return PRECEDENCE_LOGICAL_OR;
     default:                    return PRECEDENCE_NONE;
     }
 }
 
-struct Token {
-    enum Type : unsigned char {
-        NONE = 0,
+// Character classes, looked up through a 256 entry table so the lexer
+// classifies and validates each character with a single load.
+enum CharClass : unsigned char {
+    CHAR_ILLEGAL  = 0,
+    CHAR_LEGAL    = 1 << 0,
+    CHAR_SPACE    = 1 << 1,
+    CHAR_DIGIT    = 1 << 2,
+    CHAR_LETTER   = 1 << 3, // including '_'
+    CHAR_OPERATOR = 1 << 4, // including parenthesis
+
+    CHAR_WORD     = CHAR_DIGIT | CHAR_LETTER,
+};
+
+static constexpr std::array<unsigned char, 256> char_class_table = [] {
+    std::array<unsigned char, 256> table {};
+    // Ascii table - the symbols we don't need are left out
+    for (int c = ' '; c <= '~'; c++)
+        table[c] = CHAR_LEGAL;
+    for (unsigned char c : std::string_view("{}\\[]@?;:.`'\"$#"))
+        table[c] = CHAR_ILLEGAL;
+
+    table[' ']  |= CHAR_SPACE;
+    table['\t'] = CHAR_LEGAL | CHAR_SPACE;
+    for (int c = '0'; c <= '9'; c++) table[c] |= CHAR_DIGIT;
+    for (int c = 'a'; c <= 'z'; c++) table[c] |= CHAR_LETTER;
+    for (int c = 'A'; c <= 'Z'; c++) table[c] |= CHAR_LETTER;
+    table['_'] |= CHAR_LETTER;
+    for (unsigned char c : std::string_view("()*/%+-<>=!&|^~"))
+        table[c] |= CHAR_OPERATOR;
+    return table;
+}();
+
+static constexpr bool HasClass(char c, unsigned char mask) {
+    return (char_class_table[(unsigned char)c] & mask) != 0;
+}
+static constexpr bool IsLegalCharacter(char c) { return HasClass(c, CHAR_LEGAL); }
+static constexpr bool IsWordCharacter(char c)  { return HasClass(c, CHAR_WORD); }
 
-        OPERATOR,
-        OPERAND,
-    };
+// Expressions at least this long are validated up front 16 bytes at a time,
+// shorter ones are validated by the lexer as it goes.
+#ifndef PARSER_SIMD_VALIDATION_THRESHOLD
+#   define PARSER_SIMD_VALIDATION_THRESHOLD 64
+#endif
 
-    union {
-        struct {
-            short oper;
-            unsigned char precedence;
-        };
-        operand_t operand;
-    };
-    Type type;
+// Parenthesis are parsed recursively, expressions that nest them deeper than
+// this fail instead of running out of stack
+#ifndef PARSER_MAX_NESTING_DEPTH
+#   define PARSER_MAX_NESTING_DEPTH 256
+#endif
+
+// Returns the position of the first illegal character, or npos
+static size_t FindIllegalCharacter(std::string_view expr) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(' ' - 1);
+    const __m128i tilde = _mm_set1_epi8('~' + 1);
+    const __m128i tab   = _mm_set1_epi8('\t');
+    for (; i + 16 <= expr.length(); i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(expr.data() + i));
+        // signed compares: bytes >= 0x80 are negative and fall below ' '
+        __m128i legal = _mm_and_si128(_mm_cmpgt_epi8(chunk, space), _mm_cmplt_epi8(chunk, tilde));
+        legal = _mm_or_si128(legal, _mm_cmpeq_epi8(chunk, tab));
+        for (char c : std::string_view("{}\\[]@?;:.`'\"$#"))
+            legal = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)), legal);
+        unsigned int mask = ~(unsigned int)_mm_movemask_epi8(legal) & 0xFFFF;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < expr.length(); i++) {
+        if (!IsLegalCharacter(expr[i]))
+            return i;
+    }
+    return std::string_view::npos;
+}
+
+/******************************************************************************
+ *  Operand arithmetic
+ *
+ *  Whatever C++ leaves undefined for a signed operand_t is either defined here
+ *  or fails the expression, the same way for direct evaluation, compiled
+ *  code, batches and constant folding: +, -, * and unary - wrap around (two's
+ *  complement), a division by 0 or of the smallest value by -1 fails, and so
+ *  does a shift by a negative count or by the width of operand_t or more.
+ ******************************************************************************/
+
+using unsigned_operand_t = std::make_unsigned_t<operand_t>;
+// at least unsigned int, so narrow operands aren't promoted back to int
+using wrapping_operand_t = std::common_type_t<unsigned_operand_t, unsigned int>;
+static constexpr unsigned int OPERAND_BITS = sizeof(operand_t) * 8;
+
+static constexpr operand_t WrappingAdd(operand_t lhs, operand_t rhs) {
+    return (operand_t)((wrapping_operand_t)lhs + (wrapping_operand_t)rhs);
+}
+static constexpr operand_t WrappingSubtract(operand_t lhs, operand_t rhs) {
+    return (operand_t)((wrapping_operand_t)lhs - (wrapping_operand_t)rhs);
+}
+static constexpr operand_t WrappingMultiply(operand_t lhs, operand_t rhs) {
+    return (operand_t)((wrapping_operand_t)lhs * (wrapping_operand_t)rhs);
+}
+static constexpr operand_t WrappingNegate(operand_t value) {
+    return (operand_t)(0 - (wrapping_operand_t)value);
+}
+
+// The quotient of the smallest value by -1 doesn't fit (x86 traps on it), for
+// the remainder as well
+static constexpr bool DivisionFails(operand_t lhs, operand_t rhs) {
+    if (rhs == 0)
+        return true;
+    if constexpr (std::is_signed_v<operand_t>)
+        return rhs == -1 && lhs == std::numeric_limits<operand_t>::min();
+    return false;
+}
+
+// A negative count is a huge one once unsigned
+static constexpr bool ShiftFails(operand_t count) {
+    return (unsigned_operand_t)count >= OPERAND_BITS;
+}
+
+// Why a binary operator failed, see the two above
+static void LogOperatorFailure(ExpressionOpcode op, operand_t rhs) {
+    if (op == EXPR_BITWISE_LEFT || op == EXPR_BITWISE_RIGHT)
+        PARSER_LOG("shift count %lld out of range", (long long)rhs);
+    else if (rhs == 0)
+        PARSER_LOG("division by 0");
+    else
+        PARSER_LOG("division overflow");
+}
+
+static std::errc ParseLiteral(std::string_view literal, operand_t& out);
+// Returns false on an operation that fails (see above)
+static inline bool ApplyOperator(ExpressionOpcode op, operand_t lhs, operand_t rhs, operand_t& out);
+static inline operand_t ApplyUnary(ExpressionOpcode op, operand_t value);
+
+// Evaluates the expression while parsing it
+struct ValueEmitter {
+    using Value = operand_t;
+
+    bool failed = false;
+
+    Value Constant(operand_t value) { return value; }
+    Value Symbol(std::string_view) { return 0; } // unknown identifiers default to 0
+    Value Unary(ExpressionOpcode op, Value value) { return ApplyUnary(op, value); }
+    Value Binary(ExpressionOpcode op, Value lhs, Value rhs) {
+        operand_t out = 0;
+        if (!ApplyOperator(op, lhs, rhs, out)) {
+            LogOperatorFailure(op, rhs);
+            failed = true;
+        }
+        return out;
+    }
 };
 
-struct ArithmeticTokenizer {
-    std::deque<Token> tokens;
+// Emits reverse polish notation bytecode
+struct CodeEmitter {
+    using Value = char; // the values live on the evaluation stack, nothing to carry
+
+    CompiledExpression& out;
     bool failed = false;
 
-    void Tokenize(std::string_view expr);
-    void Parse(char c);
-    void Parse(std::string_view view);
-    std::queue<Token> ShuntingYard();
+    Value Constant(operand_t value) {
+        ExpressionInstruction instr {};
+        instr.opcode = EXPR_CONSTANT;
+        instr.constant = value;
+        out.code.push_back(instr);
+        return 0;
+    }
+    Value Symbol(std::string_view name) {
+        unsigned int index = 0;
+        while (index < out.symbols.size() && out.symbols[index] != name)
+            index++;
+        if (index == out.symbols.size())
+            out.symbols.emplace_back(name);
+
+        ExpressionInstruction instr {};
+        instr.opcode = EXPR_SYMBOL;
+        instr.symbol = index;
+        out.code.push_back(instr);
+        return 0;
+    }
+    Value Unary(ExpressionOpcode op, Value) {
+        ExpressionInstruction instr {};
+        instr.opcode = op;
+        out.code.push_back(instr);
+        return 0;
+    }
+    Value Binary(ExpressionOpcode op, Value, Value) {
+        ExpressionInstruction instr {};
+        instr.opcode = op;
+        out.code.push_back(instr);
+        return 0;
+    }
 };
 
-void ArithmeticTokenizer::Parse(char c) {
-    // keep track of previous token's type
-    auto prev_type = Token::NONE;
-    short prev = 0;
-    if (!this->tokens.empty()) {
-        prev_type = this->tokens.back().type;
-        prev = this->tokens.back().oper;
+// Single pass precedence climbing (Pratt) parser. Reads the characters
+// directly and hands every operand and operator to the emitter as soon as it
+// has been parsed.
+template <typename Emitter>
+struct ExpressionParser {
+    using Value = typename Emitter::Value;
+
+    std::string_view expr;
+    size_t pos = 0;
+    Emitter& emitter;
+    bool failed = false;
+    unsigned int depth = 0; // of parenthesis
+
+    char SkipSpaces() {
+        while (pos < expr.length() && HasClass(expr[pos], CHAR_SPACE))
+            pos++;
+        return pos < expr.length() ? expr[pos] : '\0';
     }
 
-    // oper is basically a char[2] in the form of a short.
+    void Fail(const char *msg) {
+        if (!failed)
+            PARSER_LOG("%s", msg);
+        failed = true;
+    }
 
-    // push_back open-parenthesis as a new operator regardless.
-    if (c == OPER_PAREN_LEFT) {
-        this->tokens.push_back({ .oper = c, .type = Token::OPERATOR});
-        return;
+    // Reads a binary operator without consuming it. Returns its length or 0
+    size_t PeekBinary(ExpressionOpcode& op) {
+        char c = SkipSpaces();
+        char n = pos + 1 < expr.length() ? expr[pos + 1] : '\0';
+        switch (c) {
+        case '*': op = EXPR_MULTIPLY;  return 1;
+        case '/': op = EXPR_DIVIDE;    return 1;
+        case '%': op = EXPR_REMAINDER; return 1;
+        case '+': op = EXPR_ADD;       return 1;
+        case '-': op = EXPR_SUBTRACT;  return 1;
+        case '^': op = EXPR_BIT_XOR;   return 1;
+        case '<':
+            if (n == '<') { op = EXPR_BITWISE_LEFT;  return 2; }
+            if (n == '=') { op = EXPR_LESSER_EQ;     return 2; }
+            op = EXPR_LESSER; return 1;
+        case '>':
+            if (n == '>') { op = EXPR_BITWISE_RIGHT; return 2; }
+            if (n == '=') { op = EXPR_GREATER_EQ;    return 2; }
+            op = EXPR_GREATER; return 1;
+        case '=':
+            if (n == '=') { op = EXPR_EQ_EQ;         return 2; }
+            return 0;
+        case '!':
+            if (n == '=') { op = EXPR_NOT_EQ;        return 2; }
+            return 0;
+        case '&':
+            if (n == '&') { op = EXPR_LOGICAL_AND;   return 2; }
+            op = EXPR_BIT_AND; return 1;
+        case '|':
+            if (n == '|') { op = EXPR_LOGICAL_OR;    return 2; }
+            op = EXPR_BIT_OR; return 1;
+        default:
+            return 0;
+        }
     }
 
-    if (prev_type != Token::OPERATOR) { // oper[0]
-        this->tokens.push_back({ .oper = c, .type = Token::OPERATOR});
-        return;
-    } else { // oper[1]
-        // Test against the previous operator and combine if possible
-        switch (prev) {
-        case OPER_LESSER:  if (c == OPER_EQ)      { this->tokens.back().oper = OPER_LESSER_EQ;   return; }
-        case OPER_GREATER: if (c == OPER_EQ)      { this->tokens.back().oper = OPER_GREATER_EQ;  return; }
-        case OPER_EQ:      if (c == OPER_EQ)      { this->tokens.back().oper = OPER_EQ_EQ;       return; }
-        case OPER_NOT:     if (c == OPER_EQ)      { this->tokens.back().oper = OPER_NOT_EQ;      return; }
-        case OPER_BIT_OR:  if (c == OPER_BIT_OR)  { this->tokens.back().oper = OPER_LOGICAL_OR;  return; }
-        case OPER_BIT_AND: if (c == OPER_BIT_AND) { this->tokens.back().oper = OPER_LOGICAL_AND; return; }
-        case OPER_PAREN_RIGHT:
-        if (c != OPER_PAREN_RIGHT) { // "()" is not allowed. (we could pop_back())
-            this->tokens.push_back({ .oper = c, .type = Token::OPERATOR});
-            return;
+    // An operand with its unary prefixes. The prefixes are skipped first and
+    // applied afterwards, innermost first, walking back over their text: a
+    // long chain of them costs no stack.
+    Value ParseOperand() {
+        char c = SkipSpaces();
+        size_t prefix_begin = pos;
+        while (c == '-' || c == '!' || c == '~' || c == '+') {
+            pos++;
+            c = SkipSpaces();
         }
-        default: break;
+        size_t prefix_end = pos;
+
+        Value value = ParsePrimary(c);
+        for (size_t i = prefix_end; i-- > prefix_begin;) {
+            switch (expr[i]) {
+            case '-': value = emitter.Unary(EXPR_NEGATE, value); break;
+            case '!': value = emitter.Unary(EXPR_LOGICAL_NOT, value); break;
+            case '~': value = emitter.Unary(EXPR_BIT_NOT, value); break;
+            default: break; // '+' and spaces
+            }
         }
-        PARSER_LOG("failed to parse operator");
-        this->failed = true;
-        return;
+        return value;
     }
-    PARSER_ASSERT(false);
-}
 
-void ArithmeticTokenizer::Parse(std::string_view tok_view) {
-    PARSER_ASSERT(tok_view.length() > 0);
+    Value ParsePrimary(char c) {
+        if (c == '(') {
+            // every level costs a few frames of ParseBinary and ParseOperand
+            if (depth == PARSER_MAX_NESTING_DEPTH) {
+                Fail("parenthesis nested too deeply");
+                return Value{};
+            }
+            pos++;
+            depth++;
+            Value value = ParseBinary(PRECEDENCE_LOWEST);
+            depth--;
+            if (SkipSpaces() != ')') {
+                Fail("failure in number of parenthesis");
+                return value;
+            }
+            pos++;
+            return value;
+        }
 
-    // prevent consecutive operands
-    if (!this->tokens.empty()) {
-        if (this->tokens.back().type == Token::OPERAND) {
-            PARSER_LOG("expected expression");
-            this->failed = true;
-            return;
+        if (!IsWordCharacter(c)) {
+            if (c != '\0' && !IsLegalCharacter(c)) {
+                PARSER_LOG("illegal character (%c) in expression", c);
+                failed = true;
+                return Value{};
+            }
+            Fail("expected expression");
+            return Value{};
         }
-    }
 
-    char *verify_length;
-    operand_t number = std::strtol(tok_view.data(), &verify_length, 10);
-    if (verify_length != tok_view.data() + tok_view.length())
-        number = 0;
-        // token is not a number (e.x. 123a would not be valid)
-        // silently default it to 0
-    tokens.push_back({ .operand = number, .type = Token::OPERAND, });
+        size_t start = pos;
+        while (pos < expr.length() && IsWordCharacter(expr[pos]))
+            pos++;
+        std::string_view word = expr.substr(start, pos - start);
 
-    return;
-}
+        if (!HasClass(c, CHAR_DIGIT))
+            return emitter.Symbol(word);
 
-static constexpr bool IsLegalCharacter(char c) {
-    // Ascii table - the symbols we don't need
-    return c >= ' '  && c <= '|' && c != '{' && c != '\\' &&
-           c != '['  && c != ']' && c != '@' && c != '?'  &&
-           c != ';'  && c != ':' && c != '.' && c != '`'  &&
-           c != '\'' && c != '"' && c != '$' && c != '#';
-}
+        operand_t number = 0;
+        std::errc error = ParseLiteral(word, number);
+        if (error == std::errc::result_out_of_range) {
+            PARSER_LOG("integer literal %.*s is too large", (int)word.length(), word.data());
+            failed = true;
+            return Value{};
+        }
+        // if the token is not a number (e.x. 123a would not be valid)
+        // silently default it to 0
+        return emitter.Constant(number);
+    }
 
-void ArithmeticTokenizer::Tokenize(std::string_view expr) {
-    // Sanitize expression
-    for (int i = 0; i < expr.size(); i++) {
-        if (!IsLegalCharacter(expr[i])) {
-            PARSER_LOG("illegal character (%c) in expression", expr[i]);
-            return;
+    Value ParseBinary(unsigned char max_precedence) {
+        Value lhs = ParseOperand();
+        while (!failed) {
+            ExpressionOpcode op;
+            size_t len = PeekBinary(op);
+            if (len == 0)
+                break;
+            unsigned char precedence = GetOpcodePrecedence(op);
+            if (precedence >= max_precedence)
+                break;
+            pos += len;
+            // left associative: the right hand side only takes tighter operators
+            Value rhs = ParseBinary(precedence);
+            lhs = emitter.Binary(op, lhs, rhs);
         }
+        return lhs;
     }
 
-    // Tokenize
-    unsigned int ptr = 0;
-    while (ptr < expr.length()) {
-        char c = expr[ptr];
-        PARSER_ASSERT(c != '\n');
-        switch (c) {
-        case ' ': case '!': case '%': case '&':
-        case '(': case ')': case '*': case '+':
-        case '-': case '/': case '<': case '=':
-        case '>': case '|':
-            // fallthrough
-            if (ptr > 0) {
-                this->Parse({expr.data(), (size_t)ptr});
-                expr.remove_prefix(ptr);
+    Value Parse() {
+        if (expr.length() >= PARSER_SIMD_VALIDATION_THRESHOLD) {
+            size_t illegal = FindIllegalCharacter(expr);
+            if (illegal != std::string_view::npos) {
+                PARSER_LOG("illegal character (%c) in expression", expr[illegal]);
+                failed = true;
+                return Value{};
             }
-            // error checking after we parse each token
-            if (this->failed)
-                return;
-
-            if (c != ' ')
-                this->Parse(c);
-            ptr = 0;
-            expr.remove_prefix(1);
+        }
 
-            break;
-        default:
-            // get rid of spaces
-            if (ptr == 0 && c == ' ')
-                expr.remove_prefix(1);
+        Value value = ParseBinary(PRECEDENCE_LOWEST);
+        if (!failed && SkipSpaces() != '\0') {
+            char c = expr[pos];
+            if (!IsLegalCharacter(c))
+                PARSER_LOG("illegal character (%c) in expression", c);
+            else if (c == ')')
+                PARSER_LOG("failure in number of parenthesis");
             else
-                ptr++;
-            break;
+                PARSER_LOG("failed to parse operator");
+            failed = true;
         }
+        failed = failed || emitter.failed;
+        return value;
     }
-    if (ptr > 0)
-        this->Parse({expr.data(), (size_t)ptr});
-
-    // Debug
-    // printf(ANSI_BLUE"Expression "ANSI_RESET"(unmodified input order):  ");
-    // for (auto const& tok: this->tokens) {
-    //     PARSER_ASSERT(tok.type != Token::NONE);
-    //     if (tok.type == Token::OPERATOR) {
-    //         short c = tok.oper;
-    //         printf("[%c%c]", c, c >> 8);
-    //     } else {
-    //         operand_t i = tok.operand;
-    //         printf("(%i)", i);
-    //     }
-    // }
-    // printf("\n");
+};
+
+static std::errc ParseLiteral(std::string_view literal, operand_t& out) {
+    using unsigned_t = std::make_unsigned_t<operand_t>;
+    out = 0;
+
+    // u, l, ul, ll, ull, ... (case insensitive)
+    int suffix = 0;
+    while (suffix < 3 && suffix < (int)literal.length()) {
+        char c = literal[literal.length() - 1 - suffix];
+        if (c != 'u' && c != 'U' && c != 'l' && c != 'L')
+            break;
+        suffix++;
+    }
+    literal.remove_suffix(suffix);
+
+    int base = 10;
+    if (literal.length() > 2 && literal[0] == '0' && (literal[1] == 'x' || literal[1] == 'X')) {
+        base = 16;
+        literal.remove_prefix(2);
+    } else if (literal.length() > 2 && literal[0] == '0' && (literal[1] == 'b' || literal[1] == 'B')) {
+        base = 2;
+        literal.remove_prefix(2);
+    } else if (literal.length() > 1 && literal[0] == '0') {
+        base = 8;
+        literal.remove_prefix(1);
+    }
+    if (literal.empty())
+        return std::errc::invalid_argument;
+
+    unsigned_t value = 0;
+    auto [end, error] = std::from_chars(literal.data(), literal.data() + literal.length(), value, base);
+    if (error != std::errc())
+        return error;
+    if (end != literal.data() + literal.length())
+        return std::errc::invalid_argument;
+
+    out = (operand_t)value;
+    return std::errc();
 }
 
+bool ParseIntegerLiteral(std::string_view literal, operand_t& out) {
+    return ParseLiteral(literal, out) == std::errc();
+}
 
-std::queue<Token> ArithmeticTokenizer::ShuntingYard() {
-    // https://en.wikipedia.org/wiki/Shunting_yard_algorithm
-    Token token;
-
-    std::queue<Token> out_queue;
-    std::stack<Token> oper_stack;
-
-    while (!this->tokens.empty()) {
-        token = this->tokens.front();
-        if (token.type == Token::OPERATOR)
-            token.precedence = GetOperatorPrecedence(token.oper);
-        this->tokens.pop_front();
-        
-        if (token.type == Token::OPERAND) {
-            out_queue.push(token);
-        } else {
-            if (token.oper == OPER_PAREN_LEFT) {
-                oper_stack.push(token);
-            } else if (token.oper == OPER_PAREN_RIGHT) {
-                while (!oper_stack.empty()) {
-                    if (oper_stack.top().oper == OPER_PAREN_LEFT)
-                        break;
-                    out_queue.push(oper_stack.top());
-                    oper_stack.pop();
-                }
-                if (oper_stack.empty()) {
-                    PARSER_LOG("failure in number of parenthesis");
-                    this->failed = true;
-                    return {};
-                }
-                if (oper_stack.top().oper == OPER_PAREN_LEFT)
-                    oper_stack.pop();
-            } else {
-                Token o1 = token;
-                while (!oper_stack.empty()) {
-                    Token o2 = oper_stack.top();
-                    if (o2.oper != OPER_PAREN_LEFT && (o1.precedence >= o2.precedence)) {
-                        oper_stack.pop();
-                        out_queue.push(o2);
-                    } else {
-                        break;
-                    }
-                }
-                oper_stack.push(o1);
-            }
-        }
+std::pair<operand_t, bool> EvaluateExpression(std::string_view expr) {
+    ValueEmitter emitter;
+    ExpressionParser<ValueEmitter> parser{ expr, 0, emitter };
+    operand_t result = parser.Parse();
+    if (parser.failed)
+        return {0, false};
+    return {result, true};
+}
 
+bool CompileExpression(std::string_view expr, CompiledExpression& out) {
+    out.code.clear();
+    out.symbols.clear();
+
+    CodeEmitter emitter{ out };
+    ExpressionParser<CodeEmitter> parser{ expr, 0, emitter };
+    parser.Parse();
+    if (parser.failed) {
+        out.code.clear();
+        out.symbols.clear();
+        return false;
     }
-    while (!oper_stack.empty()) {
-        if (oper_stack.top().oper != OPER_PAREN_LEFT) {
-            out_queue.push(oper_stack.top());
-            oper_stack.pop();
-        } else {
-            break;
-        }
+    return true;
+}
+
+// Returns false on an operation that fails
+static inline bool ApplyOperator(ExpressionOpcode op, operand_t lhs, operand_t rhs, operand_t& out) {
+    switch (op) {
+    case EXPR_MULTIPLY:      out = WrappingMultiply(lhs, rhs); break;
+    case EXPR_DIVIDE:        if (DivisionFails(lhs, rhs)) return false; out = lhs / rhs; break;
+    case EXPR_REMAINDER:     if (DivisionFails(lhs, rhs)) return false; out = lhs % rhs; break;
+    case EXPR_ADD:           out = WrappingAdd(lhs, rhs); break;
+    case EXPR_SUBTRACT:      out = WrappingSubtract(lhs, rhs); break;
+    case EXPR_BITWISE_LEFT:  if (ShiftFails(rhs)) return false; out = lhs << rhs; break;
+    case EXPR_BITWISE_RIGHT: if (ShiftFails(rhs)) return false; out = lhs >> rhs; break;
+    case EXPR_LESSER:        out = lhs <  rhs; break;
+    case EXPR_LESSER_EQ:     out = lhs <= rhs; break;
+    case EXPR_GREATER:       out = lhs >  rhs; break;
+    case EXPR_GREATER_EQ:    out = lhs >= rhs; break;
+    case EXPR_EQ_EQ:         out = lhs == rhs; break;
+    case EXPR_NOT_EQ:        out = lhs != rhs; break;
+    case EXPR_BIT_AND:       out = lhs &  rhs; break;
+    case EXPR_BIT_XOR:       out = lhs ^  rhs; break;
+    case EXPR_BIT_OR:        out = lhs |  rhs; break;
+    case EXPR_LOGICAL_AND:   out = lhs && rhs; break;
+    case EXPR_LOGICAL_OR:    out = lhs || rhs; break;
+    default: PARSER_ASSERT(false); out = 0; break;
+    }
+    return true;
+}
+
+static inline operand_t ApplyUnary(ExpressionOpcode op, operand_t value) {
+    switch (op) {
+    case EXPR_NEGATE:      return WrappingNegate(value);
+    case EXPR_LOGICAL_NOT: return !value;
+    case EXPR_BIT_NOT:     return ~value;
+    default: PARSER_ASSERT(false); return 0;
     }
+}
+
+static constexpr bool IsUnaryOpcode(ExpressionOpcode op) {
+    return op >= EXPR_NEGATE && op <= EXPR_BIT_NOT;
+}
+
+// Relational, equality and logical operators always produce 0 or 1
+static constexpr bool IsBooleanOpcode(ExpressionOpcode op) {
+    return (op >= EXPR_LESSER && op <= EXPR_NOT_EQ) ||
+           op == EXPR_LOGICAL_AND || op == EXPR_LOGICAL_OR || op == EXPR_LOGICAL_NOT;
+}
+
+// The compiled expression interpreter uses direct threading (computed goto)
+// on GCC and Clang, which gives every opcode its own indirect jump instead of
+// sharing the one at the top of a switch. Define PARSER_NO_COMPUTED_GOTO to
+// get the portable switch dispatch instead.
+#if defined(__GNUC__) && !defined(PARSER_NO_COMPUTED_GOTO)
+#   define EXPR_COMPUTED_GOTO
+#endif
 
-    // Debug
-    // printf(ANSI_BLUE"Expression "ANSI_RESET"(reverse polish notation): ");
-    // for (int i = 0; i < out_queue.size(); i++) {
-    //     auto const& tok = *(&out_queue.front() + i);
-    //     if (tok.type == Token::OPERATOR) {
-    //         short c = tok.oper;
-    //         printf("[%c%c]", c, c >> 8);
-    //     } else {
-    //         int i = tok.operand;
-    //         printf("(%i)", i);
-    //     }
-    // }
-    // printf("\n");
-
-    return out_queue;
+std::pair<operand_t, bool> EvaluateCompiled(CompiledExpression const& expr, const operand_t *symbol_values) {
+    return EvaluateCompiled(expr.code.data(), expr.code.size(), symbol_values);
 }
 
-std::pair<int, bool> EvaluateExpression(std::string_view expr) {
-    ArithmeticTokenizer tokenizer;
-    tokenizer.Tokenize(expr);
-    if (tokenizer.failed || tokenizer.tokens.size() == 0) {
+std::pair<operand_t, bool> EvaluateCompiled(const ExpressionInstruction *code, size_t length,
+                                            const operand_t *symbol_values) {
+    if (length == 0)
         return {0, false};
+
+    // The top of the stack is kept in tos, only the values below it live in
+    // memory. Every operand pushes at most one value, so length is enough.
+    operand_t small_stack[64];
+    std::vector<operand_t> large_stack;
+    operand_t *sp = small_stack;
+    if (length > sizeof(small_stack) / sizeof(small_stack[0])) {
+        large_stack.resize(length);
+        sp = large_stack.data();
     }
 
-    std::queue<Token> queue = tokenizer.ShuntingYard();
-    if (tokenizer.failed)
-        return {0, false};
+    const ExpressionInstruction *ip = code;
+    const ExpressionInstruction *const end = ip + length;
+    operand_t tos = 0;
+    operand_t rhs;
+
+#if defined(EXPR_COMPUTED_GOTO)
+    static void *const dispatch_table[] = {
+        &&TARGET_EXPR_CONSTANT,      &&TARGET_EXPR_SYMBOL,
+        &&TARGET_EXPR_MULTIPLY,      &&TARGET_EXPR_DIVIDE,        &&TARGET_EXPR_REMAINDER,
+        &&TARGET_EXPR_ADD,           &&TARGET_EXPR_SUBTRACT,
+        &&TARGET_EXPR_BITWISE_LEFT,  &&TARGET_EXPR_BITWISE_RIGHT,
+        &&TARGET_EXPR_LESSER,        &&TARGET_EXPR_LESSER_EQ,
+        &&TARGET_EXPR_GREATER,       &&TARGET_EXPR_GREATER_EQ,
+        &&TARGET_EXPR_EQ_EQ,         &&TARGET_EXPR_NOT_EQ,
+        &&TARGET_EXPR_BIT_AND,       &&TARGET_EXPR_BIT_XOR,       &&TARGET_EXPR_BIT_OR,
+        &&TARGET_EXPR_LOGICAL_AND,   &&TARGET_EXPR_LOGICAL_OR,
+        &&TARGET_EXPR_NEGATE,        &&TARGET_EXPR_LOGICAL_NOT,   &&TARGET_EXPR_BIT_NOT,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == EXPR_OPCODE_COUNT);
+#   define TARGET(op) TARGET_##op: case op
+#   define DISPATCH()                           \
+        do {                                    \
+            if (ip == end) goto done;           \
+            goto *dispatch_table[(ip++)->opcode]; \
+        } while (0)
+#else
+#   define TARGET(op) case op
+#   define DISPATCH() continue
+#endif
+#define BINARY(op, operation)           \
+    TARGET(op):                         \
+        rhs = tos;                      \
+        tos = *--sp;                    \
+        tos = operation;                \
+        DISPATCH();
+
+    while (ip != end) {
+        switch ((ip++)->opcode) {
+        TARGET(EXPR_CONSTANT):
+            *sp++ = tos;
+            tos = ip[-1].constant;
+            DISPATCH();
+        TARGET(EXPR_SYMBOL):
+            *sp++ = tos;
+            tos = symbol_values[ip[-1].symbol];
+            DISPATCH();
+
+        TARGET(EXPR_DIVIDE):
+            rhs = tos;
+            tos = *--sp;
+            if (DivisionFails(tos, rhs)) goto operation_fails;
+            tos = tos / rhs;
+            DISPATCH();
+        TARGET(EXPR_REMAINDER):
+            rhs = tos;
+            tos = *--sp;
+            if (DivisionFails(tos, rhs)) goto operation_fails;
+            tos = tos % rhs;
+            DISPATCH();
+        TARGET(EXPR_BITWISE_LEFT):
+            rhs = tos;
+            tos = *--sp;
+            if (ShiftFails(rhs)) goto operation_fails;
+            tos = tos << rhs;
+            DISPATCH();
+        TARGET(EXPR_BITWISE_RIGHT):
+            rhs = tos;
+            tos = *--sp;
+            if (ShiftFails(rhs)) goto operation_fails;
+            tos = tos >> rhs;
+            DISPATCH();
+
+        BINARY(EXPR_MULTIPLY,       WrappingMultiply(tos, rhs))
+        BINARY(EXPR_ADD,            WrappingAdd(tos, rhs))
+        BINARY(EXPR_SUBTRACT,       WrappingSubtract(tos, rhs))
+        BINARY(EXPR_LESSER,         tos <  rhs)
+        BINARY(EXPR_LESSER_EQ,      tos <= rhs)
+        BINARY(EXPR_GREATER,        tos >  rhs)
+        BINARY(EXPR_GREATER_EQ,     tos >= rhs)
+        BINARY(EXPR_EQ_EQ,          tos == rhs)
+        BINARY(EXPR_NOT_EQ,         tos != rhs)
+        BINARY(EXPR_BIT_AND,        tos &  rhs)
+        BINARY(EXPR_BIT_XOR,        tos ^  rhs)
+        BINARY(EXPR_BIT_OR,         tos |  rhs)
+        BINARY(EXPR_LOGICAL_AND,    tos && rhs)
+        BINARY(EXPR_LOGICAL_OR,     tos || rhs)
+
+        TARGET(EXPR_NEGATE):      tos = WrappingNegate(tos); DISPATCH();
+        TARGET(EXPR_LOGICAL_NOT): tos = !tos; DISPATCH();
+        TARGET(EXPR_BIT_NOT):     tos = ~tos; DISPATCH();
+
+        default:
+            PARSER_ASSERT(false);
+            return {0, false};
+        }
+    }
+#undef BINARY
+#undef DISPATCH
+#undef TARGET
+
+#if defined(EXPR_COMPUTED_GOTO)
+    done:
+#endif
+    return {tos, true};
+
+    operation_fails:
+    LogOperatorFailure(ip[-1].opcode, rhs);
+    return {0, false};
+}
+
+CompiledExpression PartialEvaluate(CompiledExpression const& expr,
+                                   std::unordered_map<std::string_view, operand_t> const& fixed) {
+    // A fragment is either a constant or the residual code of a subexpression
+    struct Fragment {
+        std::vector<ExpressionInstruction> code;
+        operand_t value;
+        bool constant;
+        bool boolean;   // residual is known to evaluate to 0 or 1
+    };
+
+    CompiledExpression result;
 
-    // Calculate
-    std::vector<int> operands;
+    // symbols that are not fixed get renumbered in the residual
+    std::vector<int> remap(expr.symbols.size(), -1);
 
-    while (!queue.empty()) {
-        Token t = queue.front();
-        queue.pop();
+    auto MakeConstant = [](operand_t value) {
+        return Fragment{ {}, value, true, value == 0 || value == 1 };
+    };
+    auto Flatten = [](Fragment& f) -> std::vector<ExpressionInstruction>& {
+        if (f.constant) {
+            ExpressionInstruction instr {};
+            instr.opcode = EXPR_CONSTANT;
+            instr.constant = f.value;
+            f.code.push_back(instr);
+            f.constant = false;
+        }
+        return f.code;
+    };
+    // x -> (x != 0), unless x is already 0 or 1
+    auto Boolify = [&](Fragment& f) {
+        if (f.boolean)
+            return std::move(f);
+        Flatten(f);
+        ExpressionInstruction instr {};
+        instr.opcode = EXPR_CONSTANT;
+        instr.constant = 0;
+        f.code.push_back(instr);
+        instr.opcode = EXPR_NOT_EQ;
+        f.code.push_back(instr);
+        f.boolean = true;
+        return std::move(f);
+    };
 
-        if (t.type == Token::OPERAND) {
-            operands.push_back(t.operand);
+    std::vector<Fragment> stack;
+    for (auto const& instr : expr.code) {
+        if (instr.opcode == EXPR_CONSTANT) {
+            stack.push_back(MakeConstant(instr.constant));
+            continue;
+        }
+        if (instr.opcode == EXPR_SYMBOL) {
+            auto kv_pair = fixed.find(expr.symbols[instr.symbol]);
+            if (kv_pair != fixed.end()) {
+                stack.push_back(MakeConstant(kv_pair->second));
+                continue;
+            }
+            if (remap[instr.symbol] < 0) {
+                remap[instr.symbol] = (int)result.symbols.size();
+                result.symbols.push_back(expr.symbols[instr.symbol]);
+            }
+            ExpressionInstruction sym {};
+            sym.opcode = EXPR_SYMBOL;
+            sym.symbol = remap[instr.symbol];
+            stack.push_back(Fragment{ {sym}, 0, false, false });
             continue;
         }
 
-        if (operands.size() < 2) {
-            PARSER_LOG("failure parsing arithmetic operation");
-            return {0, false};
+        if (IsUnaryOpcode(instr.opcode)) {
+            PARSER_ASSERT(!stack.empty());
+            Fragment& x = stack.back();
+            if (x.constant) {
+                x = MakeConstant(ApplyUnary(instr.opcode, x.value));
+                continue;
+            }
+            ExpressionInstruction oper {};
+            oper.opcode = instr.opcode;
+            x.code.push_back(oper);
+            x.boolean = IsBooleanOpcode(instr.opcode);
+            continue;
         }
 
-        int left = operands.back();
-        operands.pop_back();
-        int right = operands.back();
-        operands.pop_back();
+        PARSER_ASSERT(stack.size() >= 2);
+        Fragment rhs = std::move(stack.back());
+        stack.pop_back();
+        Fragment lhs = std::move(stack.back());
+        stack.pop_back();
+        ExpressionOpcode op = instr.opcode;
+
+        if (lhs.constant && rhs.constant) {
+            operand_t value;
+            if (ApplyOperator(op, lhs.value, rhs.value, value)) {
+                stack.push_back(MakeConstant(value));
+                continue;
+            }
+            // a failing division is left for the evaluation to report
+        } else if (lhs.constant || rhs.constant) {
+            Fragment& k = lhs.constant ? lhs : rhs;
+            Fragment& x = lhs.constant ? rhs : lhs;
+            bool k_is_rhs = rhs.constant;
+
+            switch (op) {
+            case EXPR_LOGICAL_AND:
+                if (k.value == 0) { stack.push_back(MakeConstant(0)); continue; }
+                stack.push_back(Boolify(x));
+                continue;
+            case EXPR_LOGICAL_OR:
+                if (k.value != 0) { stack.push_back(MakeConstant(1)); continue; }
+                stack.push_back(Boolify(x));
+                continue;
+            case EXPR_MULTIPLY:
+            case EXPR_BIT_AND:
+                if (k.value == 0) { stack.push_back(MakeConstant(0)); continue; }
+                if (op == EXPR_MULTIPLY && k.value == 1) { stack.push_back(std::move(x)); continue; }
+                break;
+            case EXPR_ADD:
+            case EXPR_BIT_OR:
+            case EXPR_BIT_XOR:
+                if (k.value == 0) { stack.push_back(std::move(x)); continue; }
+                break;
+            case EXPR_SUBTRACT:
+            case EXPR_BITWISE_LEFT:
+            case EXPR_BITWISE_RIGHT:
+                if (k_is_rhs && k.value == 0) { stack.push_back(std::move(x)); continue; }
+                break;
+            case EXPR_DIVIDE:
+                if (k_is_rhs && k.value == 1) { stack.push_back(std::move(x)); continue; }
+                break;
+            default: break;
+            }
+        }
 
-        if ((t.oper == OPER_DIVIDE || t.oper == OPER_REMINDER) && left == 0) {
-            PARSER_LOG("division by 0");
-            return {0, false};
+        // Residual: lhs rhs op
+        Fragment combined;
+        combined.code = std::move(Flatten(lhs));
+        auto& rhs_code = Flatten(rhs);
+        combined.code.insert(combined.code.end(), rhs_code.begin(), rhs_code.end());
+        ExpressionInstruction oper {};
+        oper.opcode = op;
+        combined.code.push_back(oper);
+        combined.constant = false;
+        combined.boolean = IsBooleanOpcode(op);
+        stack.push_back(std::move(combined));
+    }
+
+    if (stack.size() != 1)
+        return result; // expr wasn't a valid compiled expression
+
+    result.code = std::move(Flatten(stack.back()));
+
+    // folding may have dropped some of the symbols we renumbered
+    std::vector<int> used(result.symbols.size(), -1);
+    std::vector<std::string> symbols;
+    for (auto& instr : result.code) {
+        if (instr.opcode != EXPR_SYMBOL)
+            continue;
+        if (used[instr.symbol] < 0) {
+            used[instr.symbol] = (int)symbols.size();
+            symbols.push_back(std::move(result.symbols[instr.symbol]));
         }
+        instr.symbol = used[instr.symbol];
+    }
+    result.symbols = std::move(symbols);
 
-        switch (t.oper) {
-        case OPER_MULTIPLY:      operands.push_back(right *  left); break;
-        case OPER_DIVIDE:        operands.push_back(right /  left); break;
-        case OPER_REMINDER:      operands.push_back(right %  left); break;
-        case OPER_ADD:           operands.push_back(right +  left); break;
-        case OPER_SUBTRACT:      operands.push_back(right -  left); break;
-        case OPER_BITWISE_LEFT:  operands.push_back(right << left); break;
-        case OPER_BITWISE_RIGHT: operands.push_back(right >> left); break;
-        case OPER_LESSER:        operands.push_back(right <  left); break;
-        case OPER_LESSER_EQ:     operands.push_back(right <= left); break;
-        case OPER_GREATER:       operands.push_back(right >  left); break;
-        case OPER_GREATER_EQ:    operands.push_back(right >= left); break;
-        case OPER_BIT_OR:        operands.push_back(right |  left); break;
-        case OPER_BIT_XOR:       operands.push_back(right ^  left); break;
-        case OPER_BIT_AND:       operands.push_back(right &  left); break;
-        case OPER_LOGICAL_OR:    operands.push_back(right || left); break;
-        case OPER_LOGICAL_AND:   operands.push_back(right && left); break;
-        case OPER_EQ_EQ:         operands.push_back(right == left); break;
-        case OPER_NOT_EQ:        operands.push_back(right != left); break;
+    return result;
+}
+
+// Lanes are evaluated in blocks of this size. Every instruction is a simple
+// loop over one block, which the compiler turns into SIMD integer operations.
+static constexpr size_t BATCH_BLOCK = 64;
+
+bool EvaluateCompiledBatch(CompiledExpression const& expr, const operand_t *const *columns,
+                           size_t lanes, uint64_t *result, uint64_t *failed) {
+    size_t words = (lanes + BATCH_BLOCK - 1) / BATCH_BLOCK;
+    if (expr.code.empty()) {
+        for (size_t w = 0; w < words; w++) {
+            result[w] = 0;
+            if (failed)
+                failed[w] = ~uint64_t(0);
         }
+        return false;
     }
 
-    if (operands.size() != 1) {
-        PARSER_LOG("failure in number of operands");
-        return {0, false};
+    // one block per stack slot, every operand pushes at most one slot
+    std::vector<operand_t> storage(expr.code.size() * BATCH_BLOCK);
+    bool all_succeeded = true;
+
+    for (size_t block = 0; block < words; block++) {
+        size_t first = block * BATCH_BLOCK;
+        size_t count = lanes - first < BATCH_BLOCK ? lanes - first : BATCH_BLOCK;
+        operand_t *sp = storage.data();
+        uint64_t block_failed = 0;
+
+        for (auto const& instr : expr.code) {
+            if (instr.opcode == EXPR_CONSTANT) {
+                for (size_t i = 0; i < BATCH_BLOCK; i++)
+                    sp[i] = instr.constant;
+                sp += BATCH_BLOCK;
+                continue;
+            }
+            if (instr.opcode == EXPR_SYMBOL) {
+                const operand_t *column = columns[instr.symbol] + first;
+                for (size_t i = 0; i < count; i++)
+                    sp[i] = column[i];
+                for (size_t i = count; i < BATCH_BLOCK; i++)
+                    sp[i] = 0;
+                sp += BATCH_BLOCK;
+                continue;
+            }
+
+            operand_t *__restrict top = sp - BATCH_BLOCK;
+            switch (instr.opcode) {
+            case EXPR_NEGATE:      for (size_t i = 0; i < BATCH_BLOCK; i++) top[i] = WrappingNegate(top[i]); continue;
+            case EXPR_LOGICAL_NOT: for (size_t i = 0; i < BATCH_BLOCK; i++) top[i] = !top[i]; continue;
+            case EXPR_BIT_NOT:     for (size_t i = 0; i < BATCH_BLOCK; i++) top[i] = ~top[i]; continue;
+            default: break;
+            }
+
+            const operand_t *__restrict rhs = top;
+            operand_t *__restrict lhs = top - BATCH_BLOCK;
+            sp = top;
+
+#define BATCH_BINARY(op, operation)                             \
+            case op:                                            \
+                for (size_t i = 0; i < BATCH_BLOCK; i++)        \
+                    lhs[i] = operation;                         \
+                break;
+
+            switch (instr.opcode) {
+            case EXPR_DIVIDE:
+            case EXPR_REMAINDER: {
+                // divide the failing lanes by 1 and remember them
+                operand_t divisor[BATCH_BLOCK];
+                for (size_t i = 0; i < BATCH_BLOCK; i++) {
+                    bool fails = DivisionFails(lhs[i], rhs[i]);
+                    block_failed |= uint64_t(fails) << i;
+                    divisor[i] = fails ? 1 : rhs[i];
+                }
+                if (instr.opcode == EXPR_DIVIDE) {
+                    for (size_t i = 0; i < BATCH_BLOCK; i++)
+                        lhs[i] = lhs[i] / divisor[i];
+                } else {
+                    for (size_t i = 0; i < BATCH_BLOCK; i++)
+                        lhs[i] = lhs[i] % divisor[i];
+                }
+            } break;
+            case EXPR_BITWISE_LEFT:
+            case EXPR_BITWISE_RIGHT: {
+                // same for the shifts, by 0
+                operand_t count[BATCH_BLOCK];
+                for (size_t i = 0; i < BATCH_BLOCK; i++) {
+                    bool fails = ShiftFails(rhs[i]);
+                    block_failed |= uint64_t(fails) << i;
+                    count[i] = fails ? 0 : rhs[i];
+                }
+                if (instr.opcode == EXPR_BITWISE_LEFT) {
+                    for (size_t i = 0; i < BATCH_BLOCK; i++)
+                        lhs[i] = lhs[i] << count[i];
+                } else {
+                    for (size_t i = 0; i < BATCH_BLOCK; i++)
+                        lhs[i] = lhs[i] >> count[i];
+                }
+            } break;
+
+            BATCH_BINARY(EXPR_MULTIPLY,      WrappingMultiply(lhs[i], rhs[i]))
+            BATCH_BINARY(EXPR_ADD,           WrappingAdd(lhs[i], rhs[i]))
+            BATCH_BINARY(EXPR_SUBTRACT,      WrappingSubtract(lhs[i], rhs[i]))
+            BATCH_BINARY(EXPR_LESSER,        lhs[i] <  rhs[i])
+            BATCH_BINARY(EXPR_LESSER_EQ,     lhs[i] <= rhs[i])
+            BATCH_BINARY(EXPR_GREATER,       lhs[i] >  rhs[i])
+            BATCH_BINARY(EXPR_GREATER_EQ,    lhs[i] >= rhs[i])
+            BATCH_BINARY(EXPR_EQ_EQ,         lhs[i] == rhs[i])
+            BATCH_BINARY(EXPR_NOT_EQ,        lhs[i] != rhs[i])
+            BATCH_BINARY(EXPR_BIT_AND,       lhs[i] &  rhs[i])
+            BATCH_BINARY(EXPR_BIT_XOR,       lhs[i] ^  rhs[i])
+            BATCH_BINARY(EXPR_BIT_OR,        lhs[i] |  rhs[i])
+            // bitwise on purpose, so there are no branches in the loop
+            BATCH_BINARY(EXPR_LOGICAL_AND,   (lhs[i] != 0) & (rhs[i] != 0))
+            BATCH_BINARY(EXPR_LOGICAL_OR,    (lhs[i] != 0) | (rhs[i] != 0))
+
+            default:
+                PARSER_ASSERT(false);
+                break;
+            }
+#undef BATCH_BINARY
+        }
+
+        PARSER_ASSERT(sp == storage.data() + BATCH_BLOCK);
+        uint64_t bits = 0;
+        for (size_t i = 0; i < BATCH_BLOCK; i++)
+            bits |= uint64_t(storage[i] != 0) << i;
+
+        uint64_t valid = count == BATCH_BLOCK ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+        block_failed &= valid;
+        result[block] = bits & valid & ~block_failed;
+        if (failed)
+            failed[block] = block_failed;
+        if (block_failed)
+            all_succeeded = false;
     }
-    int result = operands.front();
 
-    return {result, true};
+    return all_succeeded;
 }
-
@@ -4,7 +4,17 @@
  *  Respects the order of precedence like most C-like languages.
  *  For now, it only supports multiplication, division, remainder, addition,
  *  subtraction, bit shifting, relational comparision, bitwise and logical
- *  operators.
+ *  operators, as well as unary -, !, ~ (and +).
+ *
+ *  The expression is parsed in a single pass with a precedence climbing
+ *  parser, which either evaluates it directly (EvaluateExpression) or emits
+ *  bytecode (CompileExpression).
+ *
+ *  Integer literals can be written in decimal, hexadecimal (0x), octal (0) or
+ *  binary (0b), optionally followed by u/l suffixes which are ignored.
+ *  Literals may use every bit of the operand type (e.x. 0xFFFFFFFF is -1 with
+ *  32 bit operands), like unsigned literals converted to a signed type would
+ *  in C. Literals that don't fit fail the expression.
  *
  *  Unsupported:
  *  - Only supports integers for now, but implementing floating point arithmetic
@@ -12,12 +22,14 @@
  *  - Doesn't support treating parenthesis without an operator as multiplication 
  *    like mathematical expressions do (e.x. " a (b + c) "), since this is not
  *    usually supported by programming languages or preprocessors. (not planned)
- *  - Doesn't support expressions like -a, !a, !(a + b) for now (planned).
- *    -a will have to be written as 0 - a
- *    TODO: the latter case (-a) could be solved by appending a 0 before the
- *          operand as needed when tokenizing.
- *  - Does not support consecutive operators (aside from parenthesis)
- *    (e.x. "a + - b")
+ *  - Operators are not short-circuited, "0 && 1 / 0" fails with a division
+ *    by 0 like it would without the &&.
+ *  - Parenthesis can only be nested 256 levels deep (PARSER_MAX_NESTING_DEPTH),
+ *    deeper expressions fail.
+ *
+ *  Addition, subtraction, multiplication and negation wrap around. A division
+ *  by 0 or of the smallest value by -1 fails the expression, so does a shift
+ *  by a negative count or by the width of the operand type or more.
  *
  ******************************************************************************
  *  License:
@@ -35,7 +47,103 @@
 
 #pragma once
 
+#include <cstdint>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Integer type used for operands, literals and int macros.
+// Can be changed at build time, e.x. -DPARSER_OPERAND_TYPE=int64_t
+#ifndef PARSER_OPERAND_TYPE
+#   define PARSER_OPERAND_TYPE int32_t
+#endif
+
+using operand_t = PARSER_OPERAND_TYPE;
+
+std::pair<operand_t, bool> EvaluateExpression(std::string_view expr);
+
+// Parses a C-style integer literal (see above). Returns false if the literal is
+// malformed or doesn't fit in operand_t.
+bool ParseIntegerLiteral(std::string_view literal, operand_t& out);
+
+/******************************************************************************
+ *  Compiled expressions
+ *
+ *  An expression can be compiled once into reverse polish notation and
+ *  evaluated many times. Identifiers are not defaulted to 0 like they are in
+ *  EvaluateExpression, they are kept as free symbols and their values are
+ *  supplied on evaluation (symbol_values[i] is the value of symbols[i]).
+ *
+ *  PartialEvaluate substitutes the symbols it knows the value of, folds
+ *  constants and simplifies things like "x && 0" or "x || 1". The result is a
+ *  residual expression over the remaining symbols, which can be evaluated
+ *  later or partially evaluated again.
+ *  Note: simplifications may drop a subexpression that would have failed
+ *  (e.x. "(1 / x) && 0" folds to 0 even if x ends up being 0).
+ ******************************************************************************/
+
+enum ExpressionOpcode : unsigned char {
+    EXPR_CONSTANT = 0,
+    EXPR_SYMBOL,
+
+    EXPR_MULTIPLY,
+    EXPR_DIVIDE,
+    EXPR_REMAINDER,
+    EXPR_ADD,
+    EXPR_SUBTRACT,
+    EXPR_BITWISE_LEFT,
+    EXPR_BITWISE_RIGHT,
+    EXPR_LESSER,
+    EXPR_LESSER_EQ,
+    EXPR_GREATER,
+    EXPR_GREATER_EQ,
+    EXPR_EQ_EQ,
+    EXPR_NOT_EQ,
+    EXPR_BIT_AND,
+    EXPR_BIT_XOR,
+    EXPR_BIT_OR,
+    EXPR_LOGICAL_AND,
+    EXPR_LOGICAL_OR,
+
+    // unary
+    EXPR_NEGATE,
+    EXPR_LOGICAL_NOT,
+    EXPR_BIT_NOT,
+
+    EXPR_OPCODE_COUNT,
+};
+
+struct ExpressionInstruction {
+    ExpressionOpcode opcode;
+    union {
+        operand_t constant;     // EXPR_CONSTANT
+        unsigned int symbol;    // EXPR_SYMBOL
+    };
+};
+
+struct CompiledExpression {
+    std::vector<ExpressionInstruction> code;
+    std::vector<std::string> symbols;
+
+    bool IsConstant() const { return code.size() == 1 && code[0].opcode == EXPR_CONSTANT; }
+};
+
+bool CompileExpression(std::string_view expr, CompiledExpression& out);
+std::pair<operand_t, bool> EvaluateCompiled(CompiledExpression const& expr, const operand_t *symbol_values);
+// Same as above, for bytecode stored somewhere else (e.x. a compiled source)
+std::pair<operand_t, bool> EvaluateCompiled(const ExpressionInstruction *code, size_t length,
+                                            const operand_t *symbol_values);
+CompiledExpression PartialEvaluate(CompiledExpression const& expr,
+                                   std::unordered_map<std::string_view, operand_t> const& fixed);
 
-std::pair<int, bool> EvaluateExpression(std::string_view expr);
+// Evaluates the same expression for many define sets (lanes) at once.
+// columns[i][lane] is the value of symbols[i] in that lane. Bit (lane % 64) of
+// result[lane / 64] is set when the expression is non-zero for that lane.
+// Lanes where an operation fails (a division by 0 or of the smallest value by
+// -1, a shift count out of range) are cleared in result and set in failed (if
+// given).
+// Both bitmaps need (lanes + 63) / 64 words. Returns false if any lane failed.
+bool EvaluateCompiledBatch(CompiledExpression const& expr, const operand_t *const *columns,
+                           size_t lanes, uint64_t *result, uint64_t *failed = nullptr);
 
@@ -0,0 +1,68 @@
+/******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#include "async_parse.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// The coroutines own their parse, the preprocessor is only needed to start it
+
+static SegmentGenerator RunSegments(IncrementalParse parse, std::string_view input, size_t chunk_size) {
+    std::vector<OutputSegment> segments;
+    bool ok = true;
+    while (ok && !input.empty()) {
+        size_t length = std::min(chunk_size, input.length());
+        ok = parse.Feed(input.substr(0, length), segments);
+        input.remove_prefix(length);
+        for (auto& segment : segments)
+            co_yield std::move(segment);
+        segments.clear();
+    }
+    if (ok) {
+        ok = parse.Finish(segments);
+        for (auto& segment : segments)
+            co_yield std::move(segment);
+    }
+    co_return ok;
+}
+
+SegmentGenerator ParseSegments(SimplePreprocessor const& preprocessor, std::string_view input,
+                               size_t chunk_size) {
+    return RunSegments(preprocessor.ParseIncremental(), input, std::max<size_t>(chunk_size, 1));
+}
+
+static AsyncSegmentGenerator RunSegmentsAsync(IncrementalParse parse, ChunkChannel& input) {
+    std::vector<OutputSegment> segments;
+    bool ok = true;
+    while (ok) {
+        std::optional<std::string> chunk = co_await input.Next();
+        if (!chunk)
+            break;
+        ok = parse.Feed(*chunk, segments);
+        for (auto& segment : segments)
+            co_yield std::move(segment);
+        segments.clear();
+    }
+    if (ok) {
+        ok = parse.Finish(segments);
+        for (auto& segment : segments)
+            co_yield std::move(segment);
+    }
+    co_return ok;
+}
+
+AsyncSegmentGenerator ParseSegmentsAsync(SimplePreprocessor const& preprocessor, ChunkChannel& input) {
+    return RunSegmentsAsync(preprocessor.ParseIncremental(), input);
+}
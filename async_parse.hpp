@@ -0,0 +1,246 @@
+/******************************************************************************
+ *  Coroutine parsing
+ *
+ *  C++20 coroutines over IncrementalParse, for event loops that want to mix
+ *  preprocessing with their I/O without a thread per parse, and start sending
+ *  an output before the whole input has been processed.
+ *
+ *  ParseSegments is a generator over an input that is already in memory: every
+ *  Next runs the parse until the next OutputSegment (a piece of text with the
+ *  index of its #output), chunk_size bytes of input at a time.
+ *
+ *  ParseSegmentsAsync takes its input from a ChunkChannel instead, and is
+ *  consumed with co_await from another coroutine. While it waits for input it
+ *  stays suspended, and so does the coroutine waiting for its next segment,
+ *  until the event loop pushes a chunk into the channel: the parse (and the
+ *  consumer, once a segment is out) resume from inside Push, on the thread of
+ *  the event loop.
+ *
+ *  A parse that fails ends early, after the segments that came before the
+ *  error, and Failed() tells it apart from one that finished.
+ *
+ *  Example:
+ *
+ *      ChunkChannel input;
+ *      AsyncSegmentGenerator parse = ParseSegmentsAsync(preprocessor, input);
+ *      // in a coroutine
+ *      while (std::optional<OutputSegment> segment = co_await parse.Next())
+ *          co_await Send(segment->output, segment->text);
+ *      // from the event loop
+ *      input.Push(std::move(data));
+ *      ...
+ *      input.Close();
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "simple_preprocessor.hpp"
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+class SegmentGenerator {
+public:
+    struct promise_type {
+        OutputSegment current;
+        bool failed = false;
+
+        SegmentGenerator get_return_object() {
+            return SegmentGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(OutputSegment segment) {
+            current = std::move(segment);
+            return {};
+        }
+        void return_value(bool ok) { failed = !ok; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    SegmentGenerator(SegmentGenerator&& other) noexcept :
+        handle(std::exchange(other.handle, nullptr)) {}
+    SegmentGenerator& operator=(SegmentGenerator&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~SegmentGenerator() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // Runs the parse to the next segment, returns false once it's over
+    bool Next() {
+        if (!handle || handle.done())
+            return false;
+        handle.resume();
+        return !handle.done();
+    }
+    // The segment Next stopped at, can be moved out
+    OutputSegment& Current() { return handle.promise().current; }
+    bool Failed() const { return handle && handle.done() && handle.promise().failed; }
+
+private:
+    explicit SegmentGenerator(std::coroutine_handle<promise_type> handle) :
+        handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// The input of an AsyncSegmentGenerator. Not thread safe, it's meant to be
+// pushed to from the thread that runs the coroutines.
+class ChunkChannel {
+public:
+    ChunkChannel() {}
+    ChunkChannel(ChunkChannel const&) = delete;
+    ChunkChannel& operator=(ChunkChannel const&) = delete;
+
+    // Both resume the parse waiting for input, if any, before returning
+    void Push(std::string chunk) {
+        chunks.push_back(std::move(chunk));
+        this->Wake();
+    }
+    void Close() {
+        closed = true;
+        this->Wake();
+    }
+
+    // co_await Next() gives the next chunk, or nullopt once the channel is
+    // closed and empty
+    auto Next() {
+        struct Awaiter {
+            ChunkChannel& channel;
+            std::coroutine_handle<> suspended;
+
+            // The parse may be destroyed while it waits (say its client went
+            // away), the channel must not resume it afterwards
+            ~Awaiter() {
+                if (suspended && channel.waiting == suspended)
+                    channel.waiting = nullptr;
+            }
+
+            bool await_ready() const { return !channel.chunks.empty() || channel.closed; }
+            void await_suspend(std::coroutine_handle<> waiting) {
+                suspended = waiting;
+                channel.waiting = waiting;
+            }
+            std::optional<std::string> await_resume() {
+                if (channel.chunks.empty())
+                    return std::nullopt;
+                std::string chunk = std::move(channel.chunks.front());
+                channel.chunks.pop_front();
+                return chunk;
+            }
+        };
+        return Awaiter { *this, nullptr };
+    }
+
+private:
+    void Wake() {
+        if (waiting)
+            std::exchange(waiting, nullptr).resume();
+    }
+
+    std::deque<std::string> chunks;
+    bool closed = false;
+    std::coroutine_handle<> waiting;
+};
+
+class AsyncSegmentGenerator {
+public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    // Hands control back to the coroutine waiting in Next
+    struct ResumeConsumer {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+            return handle.promise().consumer;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        OutputSegment current;
+        bool has_segment = false;
+        bool failed = false;
+        std::coroutine_handle<> consumer;
+
+        AsyncSegmentGenerator get_return_object() {
+            return AsyncSegmentGenerator(Handle::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        ResumeConsumer final_suspend() noexcept { return {}; }
+        ResumeConsumer yield_value(OutputSegment segment) {
+            current = std::move(segment);
+            has_segment = true;
+            return {};
+        }
+        void return_value(bool ok) { failed = !ok; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    AsyncSegmentGenerator(AsyncSegmentGenerator&& other) noexcept :
+        handle(std::exchange(other.handle, nullptr)) {}
+    AsyncSegmentGenerator& operator=(AsyncSegmentGenerator&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~AsyncSegmentGenerator() {
+        if (handle)
+            handle.destroy();
+    }
+
+    // co_await Next() gives the next segment, or nullopt once the parse is
+    // over. Only one coroutine can wait on it at a time.
+    auto Next() {
+        struct Awaiter {
+            Handle handle;
+
+            bool await_ready() const { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) {
+                handle.promise().consumer = consumer;
+                handle.promise().has_segment = false;
+                return handle;
+            }
+            std::optional<OutputSegment> await_resume() {
+                if (!handle || handle.done() || !handle.promise().has_segment)
+                    return std::nullopt;
+                return std::move(handle.promise().current);
+            }
+        };
+        return Awaiter { handle };
+    }
+    bool Failed() const { return handle && handle.done() && handle.promise().failed; }
+
+private:
+    explicit AsyncSegmentGenerator(Handle handle) :
+        handle(handle) {}
+
+    Handle handle;
+};
+
+// Both use the defines of the preprocessor at the time they're called, and
+// don't need it afterwards. input has to outlive the generator.
+SegmentGenerator ParseSegments(SimplePreprocessor const& preprocessor, std::string_view input,
+                               size_t chunk_size = 64 << 10);
+AsyncSegmentGenerator ParseSegmentsAsync(SimplePreprocessor const& preprocessor, ChunkChannel& input);
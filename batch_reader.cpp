@@ -0,0 +1,383 @@
+/******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#include "batch_reader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(PREPROCESSOR_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#   define BATCH_READER_IO_URING
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#endif
+
+// the first read of a file, doubled every time it fills up
+static constexpr size_t FIRST_READ_SIZE = 16 << 10;
+
+bool ReadWholeFile(std::string const& path, std::string& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    out.clear();
+    size_t length = 0;
+    size_t chunk = FIRST_READ_SIZE;
+    for (;;) {
+        out.resize(length + chunk);
+        ssize_t got = read(fd, out.data() + length, chunk);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        if (got == 0)
+            break;
+        length += got;
+        if ((size_t)got == chunk)
+            chunk *= 2;
+    }
+    close(fd);
+    out.resize(length);
+    return true;
+}
+
+#if defined(BATCH_READER_IO_URING)
+
+struct BatchFileReader::Ring {
+    unsigned int entries;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;      // the same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    io_uring_cqe *cqes;
+    unsigned int cq_mask;
+
+    unsigned int to_submit = 0;
+
+    // Returns a zeroed entry, the caller makes sure the ring has room
+    io_uring_sqe *Prepare(uint8_t opcode, int fd, uint64_t user_data) {
+        unsigned int tail = *sq_tail;
+        unsigned int index = tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        // the kernel reads the entry once it sees the new tail
+        std::atomic_ref<unsigned int>(*sq_tail).store(tail + 1, std::memory_order_release);
+        to_submit++;
+        return sqe;
+    }
+};
+
+static int IoUringSetup(unsigned int entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+BatchFileReader::BatchFileReader(unsigned int queue_depth) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = IoUringSetup(std::max(2u, queue_depth), &params);
+    if (fd < 0)
+        return;
+
+    auto ring = new Ring();
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        ring->sq_ring_size = ring->cq_ring_size = std::max(ring->sq_ring_size, ring->cq_ring_size);
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sq_ring = mmap(nullptr, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring :
+                    mmap(nullptr, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        if (!single_mmap && ring->cq_ring != MAP_FAILED)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, ring->sqes_size);
+        delete ring;
+        close(fd);
+        return;
+    }
+    ring->sqes = (io_uring_sqe *)sqes;
+
+    char *sq = (char *)ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    char *cq = (char *)ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+
+    this->ring = ring;
+    this->ring_fd = fd;
+}
+
+BatchFileReader::~BatchFileReader() {
+    this->CloseRing();
+}
+
+void BatchFileReader::CloseRing() {
+    if (ring == nullptr)
+        return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring_fd);
+    delete ring;
+    ring = nullptr;
+    ring_fd = -1;
+}
+
+void BatchFileReader::ReadRing(std::span<const std::string> paths, Callback const& done) {
+    enum FileState : unsigned char {
+        FILE_FREE = 0,
+        FILE_OPENING,
+        FILE_READING,
+    };
+    struct File {
+        FileState state = FILE_FREE;
+        int fd = -1;
+        size_t index;
+        size_t length;  // read so far
+        std::string data;
+    };
+    // closes aren't waited for, their completions are only counted
+    static constexpr uint64_t CLOSE_TAG = UINT64_MAX;
+
+    // every file has one operation in flight, and may leave a close behind
+    // when it's done, so half the ring is files
+    std::vector<File> files(std::max(1u, ring->entries / 2));
+    std::vector<uint32_t> free_files;
+    for (uint32_t i = (uint32_t)files.size(); i-- > 0;)
+        free_files.push_back(i);
+    unsigned int in_flight = 0;
+    size_t next_path = 0;
+
+    auto PrepareRead = [&](uint32_t slot) {
+        File& file = files[slot];
+        if (file.length == file.data.length())
+            file.data.resize(std::max(FIRST_READ_SIZE, file.data.length() * 2));
+        io_uring_sqe *sqe = ring->Prepare(IORING_OP_READ, file.fd, slot);
+        sqe->addr = (uint64_t)(uintptr_t)(file.data.data() + file.length);
+        sqe->len = (uint32_t)std::min<size_t>(file.data.length() - file.length, UINT32_MAX);
+        sqe->off = file.length;
+        in_flight++;
+    };
+    auto PrepareClose = [&](int fd) {
+        ring->Prepare(IORING_OP_CLOSE, fd, CLOSE_TAG);
+        in_flight++;
+    };
+    // Whatever the ring can't do is read the plain way
+    auto ReadBlocking = [&](File& file) {
+        bool ok = ReadWholeFile(paths[file.index], file.data);
+        done(file.index, ok ? &file.data : nullptr);
+    };
+    auto Release = [&](uint32_t slot) {
+        files[slot].state = FILE_FREE;
+        files[slot].fd = -1;
+        files[slot].data = {};
+        free_files.push_back(slot);
+    };
+
+    // Gives up on the ring. What was queued and never submitted is dropped (its
+    // closes are done here), what the kernel has is waited for a while, then
+    // the ring is closed, which has the kernel cancel whatever is left, before
+    // the buffers are freed. The files that weren't done are then read the
+    // plain way.
+    auto Abandon = [&]() {
+        unsigned int tail = *ring->sq_tail;
+        for (unsigned int i = tail - ring->to_submit; i != tail; i++) {
+            io_uring_sqe const& sqe = ring->sqes[ring->sq_array[i & ring->sq_mask]];
+            if (sqe.opcode == IORING_OP_CLOSE)
+                close(sqe.fd);
+        }
+        in_flight -= ring->to_submit;
+        ring->to_submit = 0;
+
+        // the completions arrive without io_uring_enter, sleeping runs the
+        // kernel's deferred work for this thread
+        for (unsigned int waited = 0; in_flight > 0 && waited < 10000; waited++) {
+            unsigned int head = *ring->cq_head;
+            unsigned int tail = std::atomic_ref<unsigned int>(*ring->cq_tail).load(std::memory_order_acquire);
+            for (; head != tail; head++) {
+                io_uring_cqe const& cqe = ring->cqes[head & ring->cq_mask];
+                in_flight--;
+                if (cqe.user_data == CLOSE_TAG)
+                    continue;
+                File& file = files[(uint32_t)cqe.user_data];
+                if (file.state == FILE_OPENING && cqe.res >= 0)
+                    file.fd = cqe.res;
+            }
+            std::atomic_ref<unsigned int>(*ring->cq_head).store(head, std::memory_order_release);
+            if (in_flight > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        this->CloseRing();
+
+        for (File& file : files) {
+            if (file.state == FILE_FREE)
+                continue;
+            if (file.fd >= 0)
+                close(file.fd);
+            file.data = {};
+            ReadBlocking(file);
+        }
+    };
+
+    while (next_path < paths.size() || in_flight > 0) {
+        while (next_path < paths.size() && !free_files.empty() && in_flight < ring->entries) {
+            uint32_t slot = free_files.back();
+            free_files.pop_back();
+            File& file = files[slot];
+            file.state = FILE_OPENING;
+            file.fd = -1;
+            file.index = next_path;
+            file.length = 0;
+            io_uring_sqe *sqe = ring->Prepare(IORING_OP_OPENAT, AT_FDCWD, slot);
+            sqe->addr = (uint64_t)(uintptr_t)paths[next_path].c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            in_flight++;
+            next_path++;
+        }
+
+        // one syscall submits the whole round and waits for the first result
+        int submitted = IoUringEnter(ring_fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+        // The kernel may be short of room (EBUSY: completions are backing
+        // up), what has completed is reaped below before submitting again
+        bool retry = submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY);
+        if (retry)
+            submitted = 0;
+        if (submitted < 0) {
+            // A broken ring: the reader goes back to blocking reads for good
+            Abandon();
+            for (; next_path < paths.size(); next_path++) {
+                File file;
+                file.index = next_path;
+                ReadBlocking(file);
+            }
+            return;
+        }
+        ring->to_submit -= std::min<unsigned int>(submitted, ring->to_submit);
+
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = std::atomic_ref<unsigned int>(*ring->cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            io_uring_cqe const& cqe = ring->cqes[head & ring->cq_mask];
+            uint64_t user_data = cqe.user_data;
+            int result = cqe.res;
+            in_flight--;
+            if (user_data == CLOSE_TAG)
+                continue;
+
+            uint32_t slot = (uint32_t)user_data;
+            File& file = files[slot];
+            if (file.state == FILE_OPENING) {
+                if (result < 0) {
+                    ReadBlocking(file);
+                    Release(slot);
+                    continue;
+                }
+                file.fd = result;
+                file.state = FILE_READING;
+                PrepareRead(slot);
+                continue;
+            }
+
+            if (result < 0) {
+                PrepareClose(file.fd);
+                ReadBlocking(file);
+                Release(slot);
+            } else if (result == 0) {
+                PrepareClose(file.fd);
+                file.data.resize(file.length);
+                done(file.index, &file.data);
+                Release(slot);
+            } else {
+                // a short read isn't the end of the file, only an empty one is
+                file.length += result;
+                PrepareRead(slot);
+            }
+        }
+        // nothing came back, give the kernel a moment before trying again
+        if (retry && *ring->cq_head == head)
+            std::this_thread::yield();
+        std::atomic_ref<unsigned int>(*ring->cq_head).store(head, std::memory_order_release);
+    }
+}
+
+#else
+
+struct BatchFileReader::Ring {};
+
+BatchFileReader::BatchFileReader(unsigned int) {}
+
+BatchFileReader::~BatchFileReader() {}
+
+void BatchFileReader::ReadRing(std::span<const std::string>, Callback const&) {}
+
+void BatchFileReader::CloseRing() {}
+
+#endif
+
+void BatchFileReader::Read(std::span<const std::string> paths, Callback const& done) {
+    if (this->UsesIoUring()) {
+        this->ReadRing(paths, done);
+        return;
+    }
+    std::string contents;
+    for (size_t i = 0; i < paths.size(); i++) {
+        bool ok = ReadWholeFile(paths[i], contents);
+        done(i, ok ? &contents : nullptr);
+    }
+}
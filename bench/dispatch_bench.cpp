@@ -0,0 +1,90 @@
+/******************************************************************************
+ *  Times EvaluateCompiled on conditionals like the ones of a variant sweep,
+ *  from a handful of instructions to a few hundred, each evaluated over a
+ *  table of define sets so the values (and the branches on them) change from
+ *  one call to the next.
+ *
+ *  The dispatch is chosen when arithmetic_parser.cpp is built, so compare a
+ *  build with direct threading (the default on GCC and Clang) to one with the
+ *  switch:
+ *
+ *  g++ -std=c++20 -O2 -I.. dispatch_bench.cpp ../arithmetic_parser.cpp
+ *  g++ -std=c++20 -O2 -I.. -DPARSER_NO_COMPUTED_GOTO dispatch_bench.cpp \
+ *      ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "arithmetic_parser.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char *EXPRESSIONS[] = {
+    "A && !B",
+    "A + B * 2 > 4 && !C",
+    "(A | 4) % 3 == 1 || (B << 2) - C >= D && ~E != 0",
+    "((A + B) * (C - D) / (E | 1)) % 16 < 8 && (A ^ B) & 3 || !(C > D) && E <= A + 7",
+};
+static constexpr size_t DEFINE_SETS = 1024;
+
+// the last expression summed a few times, up to a few hundred instructions
+static std::string MakeLongExpression(int repeats) {
+    std::string expr;
+    for (int i = 0; i < repeats; i++) {
+        if (i > 0)
+            expr += " + ";
+        expr += "(";
+        expr += EXPRESSIONS[3];
+        expr += ")";
+    }
+    return expr;
+}
+
+int main() {
+#if defined(PARSER_NO_COMPUTED_GOTO)
+    std::printf("switch dispatch\n");
+#else
+    std::printf("threaded dispatch (if the compiler supports it)\n");
+#endif
+    std::printf("%12s %12s %12s\n", "instructions", "ns/eval", "ns/instr");
+
+    std::vector<std::string> expressions(std::begin(EXPRESSIONS), std::end(EXPRESSIONS));
+    expressions.push_back(MakeLongExpression(4));
+    expressions.push_back(MakeLongExpression(16));
+
+    std::mt19937 random(42);
+    for (std::string const& source : expressions) {
+        CompiledExpression expr;
+        if (!CompileExpression(source, expr)) {
+            std::printf("doesn't compile: %s\n", source.c_str());
+            return 1;
+        }
+        // small values, so nothing overflows and the shifts stay in range
+        std::vector<operand_t> values(DEFINE_SETS * expr.symbols.size());
+        for (operand_t& value : values)
+            value = (operand_t)(random() % 16);
+
+        volatile operand_t sink = 0;
+        size_t rounds = 1;
+        double seconds;
+        for (;;) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t sum = 0;
+            for (size_t round = 0; round < rounds; round++) {
+                for (size_t set = 0; set < DEFINE_SETS; set++)
+                    sum += EvaluateCompiled(expr, values.data() + set * expr.symbols.size()).first;
+            }
+            sink = sink + (operand_t)sum;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds > 0.2)
+                break;
+            rounds *= 2;
+        }
+        double per_eval = seconds * 1e9 / (rounds * DEFINE_SETS);
+        std::printf("%12zu %12.1f %12.2f\n", expr.code.size(), per_eval, per_eval / expr.code.size());
+    }
+    return 0;
+}
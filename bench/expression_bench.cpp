@@ -0,0 +1,81 @@
+/******************************************************************************
+ *  Times EvaluateExpression and CompileExpression on generated expressions of
+ *  10 to 10000 terms: literals in every base, identifiers, unary operators,
+ *  parenthesized groups and spaces and tabs between them, so the lexer goes
+ *  through every character class.
+ *
+ *  To see what the up front SSE2 validation of long expressions is worth,
+ *  build a second time with it disabled and compare:
+ *
+ *  g++ -std=c++20 -O2 -I.. expression_bench.cpp ../arithmetic_parser.cpp
+ *  g++ -std=c++20 -O2 -I.. -DPARSER_SIMD_VALIDATION_THRESHOLD=SIZE_MAX \
+ *      expression_bench.cpp ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "arithmetic_parser.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// The operators never overflow on the small values the terms have, and the
+// only divisors are literals that aren't 0
+static std::string MakeExpression(int terms, std::mt19937& random) {
+    static const char *OPERATORS[] = { " + ", " - ", " & ", " | ", " ^ ", "\t+\t", " == ", " != ", " < ", " >= " };
+    static const char *IDENTIFIERS[] = { "FOO", "bar_2", "_baz", "SOME_LONGER_MACRO_NAME" };
+    std::string expr;
+    for (int i = 0; i < terms; i++) {
+        if (i > 0)
+            expr += OPERATORS[random() % 10];
+        switch (random() % 6) {
+        case 0: expr += std::to_string(random() % 1000); break;
+        case 1: expr += "0x" + std::to_string(random() % 10) + "Fu"; break;
+        case 2: expr += "0b101"; break;
+        case 3: expr += IDENTIFIERS[random() % 4]; break;
+        case 4: expr += (random() % 2) ? "~" : "!"; expr += std::to_string(random() % 100); break;
+        case 5: expr += "(" + std::to_string(random() % 1000) + " % 7)"; break;
+        }
+    }
+    return expr;
+}
+
+template <typename Function>
+static double NanosecondsPerCall(Function&& function) {
+    // enough calls to run for ~0.2s, whatever the size
+    size_t calls = 1;
+    for (;;) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; i++)
+            function();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds > 0.2)
+            return seconds * 1e9 / calls;
+        calls *= 2;
+    }
+}
+
+int main() {
+    std::printf("%6s %8s %14s %10s %14s %10s\n", "terms", "bytes", "evaluate ns", "MB/s", "compile ns", "MB/s");
+
+    std::mt19937 random(42);
+    for (int terms : { 10, 30, 100, 300, 1000, 3000, 10000 }) {
+        std::string expr = MakeExpression(terms, random);
+        if (!EvaluateExpression(expr).second) {
+            std::printf("%d terms: the generated expression doesn't evaluate\n", terms);
+            return 1;
+        }
+
+        volatile operand_t sink = 0;
+        double evaluate = NanosecondsPerCall([&] { sink = sink + EvaluateExpression(expr).first; });
+        CompiledExpression compiled;
+        double compile = NanosecondsPerCall([&] {
+            CompileExpression(expr, compiled);
+            sink = sink + (operand_t)compiled.code.size();
+        });
+        std::printf("%6d %8zu %14.0f %10.1f %14.0f %10.1f\n", terms, expr.length(),
+                    evaluate, expr.length() / evaluate * 1e3, compile, expr.length() / compile * 1e3);
+    }
+    return 0;
+}
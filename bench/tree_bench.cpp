@@ -0,0 +1,112 @@
+/******************************************************************************
+ *  Times PreprocessTree on a synthetic tree whose file sizes follow a Pareto
+ *  distribution: most files are a few KB, a handful are tens of MB, like the
+ *  source trees of the batch jobs. Every thread count runs on the same tree,
+ *  with the input and output written once beforehand so the page cache is
+ *  warm for all of them.
+ *
+ *  tree_bench [files] [directory]
+ *
+ *  g++ -std=c++20 -O2 -pthread -I.. tree_bench.cpp ../tree_preprocessor.cpp \
+ *      ../batch_reader.cpp ../simple_preprocessor.cpp ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "tree_preprocessor.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Pareto with this shape and minimum: a mean around 20KB, and the biggest of
+// 20000 files in the tens of MB
+static constexpr double SIZE_SHAPE = 1.1;
+static constexpr double SIZE_MINIMUM = 2 << 10;
+static constexpr double SIZE_MAXIMUM = 64 << 20;
+static constexpr int FILES_PER_DIRECTORY = 200;
+
+static std::string MakeSource(size_t size, std::mt19937_64& random) {
+    static const char *BLOCKS[] = {
+        "#if A > 1 && B\n",
+        "#if (C | 4) % 3 == 1\n",
+        "#if !D || E < 10\n",
+    };
+    std::string source;
+    source.reserve(size + 128);
+    while (source.length() < size) {
+        source += BLOCKS[random() % 3];
+        source += "int value = A + B * C; // some code under a branch\n";
+        source += "#else\n";
+        source += "int value = 0;\n";
+        source += "#endif\n";
+        if (random() % 64 == 0)
+            source += "#output 1\n";
+        source += "plain text that every variant keeps, for the copies\n";
+    }
+    return source;
+}
+
+static uint64_t WriteTree(std::filesystem::path const& root, int files) {
+    std::mt19937_64 random(42);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    uint64_t total = 0;
+    for (int i = 0; i < files; i++) {
+        double size = SIZE_MINIMUM / std::pow(1.0 - uniform(random), 1.0 / SIZE_SHAPE);
+        size = std::min(size, SIZE_MAXIMUM);
+        // a couple of levels, so the listing is spread over tasks too
+        std::filesystem::path directory = root / ("d" + std::to_string(i / FILES_PER_DIRECTORY % 8))
+                                               / ("e" + std::to_string(i / FILES_PER_DIRECTORY));
+        std::filesystem::create_directories(directory);
+        std::string source = MakeSource((size_t)size, random);
+        std::ofstream(directory / ("f" + std::to_string(i) + ".txt"), std::ios::binary) << source;
+        total += source.length();
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    int files = argc > 1 ? std::atoi(argv[1]) : 20000;
+    std::filesystem::path root = argc > 2 ? argv[2] :
+        std::filesystem::temp_directory_path() / "tree_bench";
+    std::filesystem::remove_all(root);
+    uint64_t bytes = WriteTree(root / "in", files);
+    std::printf("%d files, %.1f MB\n", files, bytes / 1e6);
+
+    SimplePreprocessor preprocessor;
+    preprocessor.Define("A", 2);
+    preprocessor.Define("C", 7);
+    preprocessor.Define("E", 3);
+
+    std::vector<unsigned int> thread_counts { 1, 2, 4 };
+    unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int count = 8; count < hardware; count *= 2)
+        thread_counts.push_back(count);
+    if (hardware > 4)
+        thread_counts.push_back(hardware);
+
+    // one untimed pass creates the output tree and warms the page cache
+    PreprocessTree(preprocessor, (root / "in").string(), (root / "out").string());
+
+    double single = 0;
+    for (unsigned int threads : thread_counts) {
+        auto start = std::chrono::steady_clock::now();
+        TreeStats stats = PreprocessTree(preprocessor, (root / "in").string(), (root / "out").string(), threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (threads == 1)
+            single = seconds;
+        std::printf("%3u threads: %8.1f ms  %7.1f MB/s  x%.2f  (%llu files, %llu failed, %llu errors)\n",
+                    threads, seconds * 1e3, stats.bytes_in / seconds / 1e6, single / seconds,
+                    (unsigned long long)stats.files, (unsigned long long)stats.failed,
+                    (unsigned long long)stats.errors);
+    }
+
+    std::filesystem::remove_all(root);
+    return 0;
+}
@@ -0,0 +1,342 @@
+/******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#include "precompiled_source.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum PrecompiledSection {
+    SECTION_TEXT = 0,
+    SECTION_NODES,
+    SECTION_WORDS,
+    SECTION_SYMBOL_NAMES,
+    SECTION_SYMBOL_OFFSETS,
+    SECTION_CODE,
+    SECTION_COUNT,
+};
+
+struct PrecompiledHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t library_version;
+    // sizes of the records, they depend on operand_t and the compiler
+    uint32_t node_size;
+    uint32_t word_size;
+    uint32_t instruction_size;
+    uint32_t operand_size;
+    struct {
+        uint64_t offset;    // from the start of the file
+        uint64_t count;     // in records
+    } sections[SECTION_COUNT];
+};
+
+static constexpr char PRECOMPILED_MAGIC[8] = { 'S', 'P', 'P', 'S', 'R', 'C', '\0', '\0' };
+static constexpr uint32_t PRECOMPILED_FORMAT_VERSION = 1;
+
+static inline uint64_t Align8(uint64_t value) {
+    return (value + 7) & ~(uint64_t)7;
+}
+
+static PrecompiledHeader MakeHeader() {
+    PrecompiledHeader header {};
+    std::memcpy(header.magic, PRECOMPILED_MAGIC, sizeof(PRECOMPILED_MAGIC));
+    header.format_version = PRECOMPILED_FORMAT_VERSION;
+    header.library_version = SIMPLE_PREPROCESSOR_VERSION;
+    header.node_size = sizeof(CompiledSource::Node);
+    header.word_size = sizeof(CompiledSource::Word);
+    header.instruction_size = sizeof(ExpressionInstruction);
+    header.operand_size = sizeof(operand_t);
+    return header;
+}
+
+// Nodes and instructions are copied field by field into zeroed records: their
+// padding, and the part of an instruction's operand its opcode doesn't use,
+// hold whatever was in memory when they were built
+static std::string PackNodes(std::vector<CompiledSource::Node> const& nodes) {
+    using Node = CompiledSource::Node;
+    std::string out(nodes.size() * sizeof(Node), '\0');
+    for (size_t i = 0; i < nodes.size(); i++) {
+        char *record = out.data() + i * sizeof(Node);
+        auto Put = [&](size_t offset, auto const& value) {
+            std::memcpy(record + offset, &value, sizeof(value));
+        };
+        Node const& node = nodes[i];
+        Put(offsetof(Node, kind), node.kind);
+        Put(offsetof(Node, line), node.line);
+        Put(offsetof(Node, begin), node.begin);
+        Put(offsetof(Node, end), node.end);
+        Put(offsetof(Node, first_word), node.first_word);
+        Put(offsetof(Node, last_word), node.last_word);
+        Put(offsetof(Node, code_begin), node.code_begin);
+        Put(offsetof(Node, code_end), node.code_end);
+        Put(offsetof(Node, next), node.next);
+        Put(offsetof(Node, endif), node.endif);
+    }
+    return out;
+}
+
+static std::string PackCode(std::vector<ExpressionInstruction> const& code) {
+    std::string out(code.size() * sizeof(ExpressionInstruction), '\0');
+    for (size_t i = 0; i < code.size(); i++) {
+        char *record = out.data() + i * sizeof(ExpressionInstruction);
+        auto Put = [&](size_t offset, auto const& value) {
+            std::memcpy(record + offset, &value, sizeof(value));
+        };
+        ExpressionInstruction const& instr = code[i];
+        Put(offsetof(ExpressionInstruction, opcode), instr.opcode);
+        if (instr.opcode == EXPR_CONSTANT)
+            Put(offsetof(ExpressionInstruction, constant), instr.constant);
+        else if (instr.opcode == EXPR_SYMBOL)
+            Put(offsetof(ExpressionInstruction, symbol), instr.symbol);
+    }
+    return out;
+}
+
+std::string SerializeCompiledSource(CompiledSource const& source) {
+    std::string nodes = PackNodes(source.nodes);
+    std::string code = PackCode(source.code);
+    struct {
+        const void *data;
+        uint64_t count;
+        uint64_t size;
+    } sections[SECTION_COUNT] = {
+        { source.text.data(),           source.text.length(),           1 },
+        { nodes.data(),                 source.nodes.size(),            sizeof(CompiledSource::Node) },
+        { source.words.data(),          source.words.size(),            sizeof(CompiledSource::Word) },
+        { source.symbol_names.data(),   source.symbol_names.length(),   1 },
+        { source.symbol_offsets.data(), source.symbol_offsets.size(),   sizeof(uint32_t) },
+        { code.data(),                  source.code.size(),             sizeof(ExpressionInstruction) },
+    };
+
+    PrecompiledHeader header = MakeHeader();
+    uint64_t offset = Align8(sizeof(header));
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].count = sections[i].count;
+        offset = Align8(offset + sections[i].count * sections[i].size);
+    }
+
+    // zero filled, padding included, so equal sources give equal files
+    std::string out(offset, '\0');
+    std::memcpy(out.data(), &header, sizeof(header));
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        if (sections[i].count > 0)
+            std::memcpy(out.data() + header.sections[i].offset, sections[i].data, sections[i].count * sections[i].size);
+    }
+    return out;
+}
+
+bool SaveCompiledSource(CompiledSource const& source, std::string const& path) {
+    std::string contents = SerializeCompiledSource(source);
+
+    static std::atomic<uint64_t> counter {0};
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".tmp.%d.%llu", (int)getpid(),
+                  (unsigned long long)counter.fetch_add(1));
+    std::string tmp_path = path + suffix;
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    const char *data = contents.data();
+    size_t remaining = contents.length();
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+    close(fd);
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The runner trusts the skeleton completely, so everything it could follow
+// has to stay inside the sections
+static bool ValidateView(CompiledSourceView const& view) {
+    if (view.text.empty() || view.text.back() != '\n')
+        return false;
+
+    if (view.symbol_offsets.empty() || view.symbol_offsets[0] != 0 ||
+        view.symbol_offsets.back() != view.symbol_names.length())
+        return false;
+    for (size_t i = 1; i < view.symbol_offsets.size(); i++) {
+        if (view.symbol_offsets[i] < view.symbol_offsets[i - 1])
+            return false;
+    }
+    size_t symbol_count = view.SymbolCount();
+
+    for (auto const& word : view.words) {
+        if (word.symbol >= symbol_count || word.offset > view.text.length() ||
+            word.length > view.text.length() - word.offset)
+            return false;
+    }
+
+    for (auto const& instr : view.code) {
+        if (instr.opcode >= EXPR_OPCODE_COUNT ||
+            (instr.opcode == EXPR_SYMBOL && instr.symbol >= symbol_count))
+            return false;
+    }
+
+    size_t node_count = view.nodes.size();
+    for (size_t i = 0; i < node_count; i++) {
+        CompiledSource::Node const& node = view.nodes[i];
+        if (node.kind > CompiledSource::NODE_OUTPUT ||
+            node.begin > node.end || node.end > view.text.length() ||
+            node.first_word > node.last_word || node.last_word > view.words.size())
+            return false;
+        for (uint32_t w = node.first_word; w < node.last_word; w++) {
+            CompiledSource::Word const& word = view.words[w];
+            if (word.offset < node.begin || word.offset + word.length > node.end ||
+                (w > node.first_word && word.offset < view.words[w - 1].offset + view.words[w - 1].length))
+                return false;
+        }
+
+        bool branch = node.kind == CompiledSource::NODE_IF || node.kind == CompiledSource::NODE_ELIF ||
+                      node.kind == CompiledSource::NODE_ELSE;
+        if (!branch)
+            continue;
+        // the runner only ever jumps forward, to a branch or to an endif
+        if (node.next <= i || node.next >= node_count || node.endif < node.next || node.endif >= node_count ||
+            view.nodes[node.endif].kind != CompiledSource::NODE_ENDIF)
+            return false;
+        CompiledSource::NodeKind next = view.nodes[node.next].kind;
+        if (next != CompiledSource::NODE_ELIF && next != CompiledSource::NODE_ELSE && next != CompiledSource::NODE_ENDIF)
+            return false;
+
+        if (node.kind == CompiledSource::NODE_ELSE)
+            continue;
+        if (node.code_begin > node.code_end || node.code_end > view.code.size())
+            return false;
+        if (node.code_begin == node.code_end)
+            continue;
+        // every instruction needs its operands on the stack, and one value is left
+        size_t depth = 0;
+        for (uint32_t c = node.code_begin; c < node.code_end; c++) {
+            ExpressionOpcode opcode = view.code[c].opcode;
+            if (opcode == EXPR_CONSTANT || opcode == EXPR_SYMBOL)
+                depth++;
+            else if (opcode >= EXPR_NEGATE)
+                depth = depth >= 1 ? depth : SIZE_MAX;
+            else
+                depth = depth >= 2 ? depth - 1 : SIZE_MAX;
+            if (depth == SIZE_MAX)
+                return false;
+        }
+        if (depth != 1)
+            return false;
+    }
+    return true;
+}
+
+bool LoadCompiledSource(std::string_view data, CompiledSourceView& out) {
+    if (data.length() < sizeof(PrecompiledHeader) || (uintptr_t)data.data() % 8 != 0)
+        return false;
+
+    PrecompiledHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    PrecompiledHeader expected = MakeHeader();
+    if (std::memcmp(&header, &expected, offsetof(PrecompiledHeader, sections)) != 0)
+        return false;
+
+    const uint64_t sizes[SECTION_COUNT] = {
+        1, sizeof(CompiledSource::Node), sizeof(CompiledSource::Word),
+        1, sizeof(uint32_t), sizeof(ExpressionInstruction),
+    };
+    const char *sections[SECTION_COUNT];
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        uint64_t offset = header.sections[i].offset;
+        uint64_t count = header.sections[i].count;
+        if (offset % 8 != 0 || offset > data.length() || count > (data.length() - offset) / sizes[i])
+            return false;
+        sections[i] = data.data() + offset;
+    }
+
+    CompiledSourceView view;
+    view.text = { sections[SECTION_TEXT], header.sections[SECTION_TEXT].count };
+    view.nodes = { (const CompiledSource::Node *)sections[SECTION_NODES], header.sections[SECTION_NODES].count };
+    view.words = { (const CompiledSource::Word *)sections[SECTION_WORDS], header.sections[SECTION_WORDS].count };
+    view.symbol_names = { sections[SECTION_SYMBOL_NAMES], header.sections[SECTION_SYMBOL_NAMES].count };
+    view.symbol_offsets = { (const uint32_t *)sections[SECTION_SYMBOL_OFFSETS],
+                            header.sections[SECTION_SYMBOL_OFFSETS].count };
+    view.code = { (const ExpressionInstruction *)sections[SECTION_CODE], header.sections[SECTION_CODE].count };
+    if (!ValidateView(view))
+        return false;
+
+    out = view;
+    return true;
+}
+
+MappedCompiledSource::~MappedCompiledSource() {
+    Close();
+}
+
+void MappedCompiledSource::Close() {
+    if (base != nullptr)
+        munmap(base, length);
+    base = nullptr;
+    length = 0;
+    view = {};
+}
+
+bool MappedCompiledSource::Open(std::string const& path) {
+    Close();
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t file_length = st.st_size;
+    void *mapping = mmap(nullptr, file_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    CompiledSourceView loaded;
+    if (!LoadCompiledSource({ (const char *)mapping, file_length }, loaded)) {
+        munmap(mapping, file_length);
+        return false;
+    }
+
+    base = mapping;
+    length = file_length;
+    view = loaded;
+    return true;
+}
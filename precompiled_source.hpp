@@ -0,0 +1,74 @@
+/******************************************************************************
+ *  Precompiled sources
+ *
+ *  A binary form of CompiledSource that can be used straight from memory: the
+ *  text, the node skeleton, the word occurrences, the symbol names and the
+ *  expression bytecode, each one a section of the file. Loading it only checks
+ *  that the sections are consistent (no index points outside of them and the
+ *  bytecode is well formed), nothing is parsed or copied, so a large source
+ *  shipped precompiled is ready to run as soon as it's mapped.
+ *
+ *  Every offset in the file is relative to its start, so it can be mapped at
+ *  any address or embedded in a binary. The header carries a format version,
+ *  SIMPLE_PREPROCESSOR_VERSION and the sizes of the records, files written by
+ *  another version (or a build with another operand_t) are refused. Values are
+ *  stored in native endianness.
+ *
+ *  Layout:
+ *      PrecompiledHeader
+ *      sections (text, nodes, words, symbol names, symbol offsets, code),
+ *      each 8 byte aligned
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "simple_preprocessor.hpp"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Returns the binary form of source
+std::string SerializeCompiledSource(CompiledSource const& source);
+
+// Writes the binary form of source to path (through a temporary file, so a
+// reader never maps half of it)
+bool SaveCompiledSource(CompiledSource const& source, std::string const& path);
+
+// Points out into data, which has to be 8 byte aligned and outlive out.
+// Returns false if data isn't a valid precompiled source for this version.
+bool LoadCompiledSource(std::string_view data, CompiledSourceView& out);
+
+// A precompiled source file mapped into memory (POSIX only)
+class MappedCompiledSource {
+public:
+    MappedCompiledSource() {}
+    ~MappedCompiledSource();
+    MappedCompiledSource(MappedCompiledSource const&) = delete;
+    MappedCompiledSource& operator=(MappedCompiledSource const&) = delete;
+
+    // Returns false if the file can't be mapped or isn't valid
+    bool Open(std::string const& path);
+    void Close();
+
+    // Only valid while the file stays open
+    CompiledSourceView View() const { return view; }
+
+private:
+    void *base = nullptr;
+    size_t length = 0;
+    CompiledSourceView view;
+};
@@ -0,0 +1,858 @@
+/******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.  
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#include "preprocessor_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline uint64_t Mix(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t HashBytes(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t h = Mix(seed ^ (length * 0x9E3779B97F4A7C15ull));
+
+    // 8 bytes at a time, folding two lanes to keep the multiplies independent
+    uint64_t h2 = h ^ 0x6A09E667F3BCC909ull;
+    while (length >= 16) {
+        uint64_t a, b;
+        std::memcpy(&a, bytes, 8);
+        std::memcpy(&b, bytes + 8, 8);
+        h  = (h  ^ Mix(a)) * 0x9E3779B97F4A7C15ull;
+        h2 = (h2 ^ Mix(b)) * 0xC2B2AE3D27D4EB4Full;
+        bytes += 16;
+        length -= 16;
+    }
+    if (length >= 8) {
+        uint64_t a;
+        std::memcpy(&a, bytes, 8);
+        h = (h ^ Mix(a)) * 0x9E3779B97F4A7C15ull;
+        bytes += 8;
+        length -= 8;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes, length);
+    h2 = (h2 ^ Mix(tail ^ length)) * 0xC2B2AE3D27D4EB4Full;
+
+    return Mix(h ^ (h2 >> 29) ^ h2);
+}
+
+static size_t OutputBytes(std::vector<std::string> const& output) {
+    size_t total = sizeof(output);
+    for (auto const& str : output)
+        total += sizeof(str) + str.capacity();
+    return total;
+}
+
+static std::string SourceKey(std::string_view input) {
+    // hash and length, so a collision would also need the same length
+    uint64_t parts[2] = { HashBytes(input.data(), input.length()), input.length() };
+    return std::string((const char *)parts, sizeof(parts));
+}
+
+PreprocessorCache::Output PreprocessorCache::Parse(SimplePreprocessor const& preprocessor, std::string_view input) {
+    // The lookups, the parse and the key of its output all use this one
+    // snapshot of the defines, a Define in between would file the output
+    // under values it wasn't produced with
+    SimplePreprocessor pinned = preprocessor;
+    std::string source_key = ::SourceKey(input);
+
+    std::vector<std::vector<std::string>> dependency_sets;
+    {
+        std::lock_guard lock(mutex);
+        auto source = sources.find(source_key);
+        if (source != sources.end())
+            dependency_sets = source->second.dependency_sets;
+    }
+
+    // The values are computed outside the lock, they only depend on the preprocessor
+    std::vector<std::string> keys;
+    for (auto const& names : dependency_sets) {
+        std::string key = source_key;
+        pinned.AppendDefineValues(names, key);
+        keys.push_back(std::move(key));
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        for (auto const& key : keys) {
+            auto entry = entries.find(key);
+            if (entry == entries.end())
+                continue;
+            // move to the front
+            lru.splice(lru.begin(), lru, entry->second);
+            hits++;
+            return entry->second->output;
+        }
+        misses++;
+    }
+
+    std::vector<std::string> dependencies;
+    auto output = std::make_shared<const std::vector<std::string>>(
+        pinned.Parse(input.data(), input.length(), &dependencies));
+    if (output->empty())
+        return output;
+
+    std::string key = source_key;
+    pinned.AppendDefineValues(dependencies, key);
+
+    std::lock_guard lock(mutex);
+    auto& known = sources[source_key].dependency_sets;
+    if (std::find(known.begin(), known.end(), dependencies) == known.end())
+        known.push_back(std::move(dependencies));
+    Insert(std::move(key), output);
+    return output;
+}
+
+void PreprocessorCache::Insert(std::string key, Output output) {
+    if (entries.find(key) != entries.end())
+        return; // another thread got there first
+
+    size_t entry_bytes = OutputBytes(*output) + key.capacity();
+    if (entry_bytes > max_bytes)
+        return;
+
+    lru.push_front({ std::move(key), std::move(output), entry_bytes });
+    entries[lru.front().key] = lru.begin();
+    bytes += entry_bytes;
+
+    while (bytes > max_bytes) {
+        Entry& victim = lru.back();
+        entries.erase(victim.key);
+        bytes -= victim.bytes;
+        lru.pop_back();
+    }
+}
+
+PreprocessorCache::Stats PreprocessorCache::GetStats() const {
+    std::lock_guard lock(mutex);
+    return { hits, misses, bytes, lru.size() };
+}
+
+void PreprocessorCache::Clear() {
+    std::lock_guard lock(mutex);
+    entries.clear();
+    lru.clear();
+    sources.clear();
+    bytes = 0;
+}
+
+/******************************************************************************
+ *  Disk cache
+ *
+ *  <hash>.deps: the dependency sets seen for a source, one per line, names
+ *               separated by spaces. <hash> is the hash of the source key.
+ *  <hash>.out:  a result. <hash> is the hash of the full key, which is also
+ *               stored in the file and compared, so a hash collision is a miss.
+ *
+ *  Result layout (native endianness, it's a cache, not an exchange format):
+ *      DiskHeader
+ *      key bytes
+ *      uint64_t offsets[output_count + 1] (relative to the output data)
+ *      output data
+ ******************************************************************************/
+
+struct DiskHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t library_version;
+    uint64_t key_length;
+    uint64_t output_count;
+};
+
+static constexpr char DISK_MAGIC[8] = { 'S', 'P', 'P', 'C', 'A', 'C', 'H', 'E' };
+static constexpr uint32_t DISK_FORMAT_VERSION = 1;
+
+// Evict at most once every this many writes, scanning the directory isn't free
+static constexpr uint64_t DISK_EVICTION_INTERVAL = 32;
+// Temporary files this old were left by a writer that died before renaming
+// them. Removing one that is still being written only fails that write.
+static constexpr std::chrono::minutes DISK_STALE_TEMP_AGE { 10 };
+
+PreprocessorDiskCache::MappedOutput::~MappedOutput() {
+    if (base != nullptr)
+        munmap(base, length);
+}
+
+std::shared_ptr<const PreprocessorDiskCache::MappedOutput>
+PreprocessorDiskCache::MappedOutput::Copy(std::vector<std::string> const& output) {
+    size_t total = 0;
+    for (auto const& str : output)
+        total += str.length();
+    void *base = total > 0 ? mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : nullptr;
+    if (base == MAP_FAILED)
+        return nullptr;
+    auto copy = std::make_shared<MappedOutput>(base, total);
+    char *dst = (char *)base;
+    for (auto const& str : output) {
+        std::memcpy(dst, str.data(), str.length());
+        copy->outputs.emplace_back(dst, str.length());
+        dst += str.length();
+    }
+    return copy;
+}
+
+PreprocessorDiskCache::PreprocessorDiskCache(std::string directory, uint64_t max_bytes) :
+    directory(std::move(directory)), max_bytes(max_bytes) {
+    std::error_code error;
+    std::filesystem::create_directories(this->directory, error);
+}
+
+std::string PreprocessorDiskCache::Path(uint64_t hash, const char *extension) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.%s", (unsigned long long)hash, extension);
+    return directory + name;
+}
+
+std::vector<std::vector<std::string>> PreprocessorDiskCache::ReadDependencies(std::string const& path) const {
+    std::vector<std::vector<std::string>> sets;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> names;
+        size_t pos = 0;
+        while (pos < line.length()) {
+            size_t end = line.find(' ', pos);
+            if (end == std::string::npos)
+                end = line.length();
+            if (end > pos)
+                names.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        sets.push_back(std::move(names));
+    }
+    return sets;
+}
+
+void PreprocessorDiskCache::WriteDependencies(std::string const& path,
+                                              std::vector<std::vector<std::string>> const& sets) {
+    std::string contents;
+    for (auto const& names : sets) {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (i > 0)
+                contents.push_back(' ');
+            contents.append(names[i]);
+        }
+        contents.push_back('\n');
+    }
+    WriteAtomically(path, contents);
+}
+
+bool PreprocessorDiskCache::WriteAtomically(std::string const& path, std::string_view contents) {
+    static std::atomic<uint64_t> counter {0};
+    char suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".tmp.%d.%llu", (int)getpid(),
+                  (unsigned long long)counter.fetch_add(1));
+    std::string tmp_path = path + suffix;
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    const char *data = contents.data();
+    size_t remaining = contents.length();
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+    close(fd);
+
+    // readers either see the old file, the new one or nothing, never half of it
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool PreprocessorDiskCache::Write(std::string const& path, std::string_view key,
+                                  std::vector<std::string> const& output) {
+    DiskHeader header;
+    std::memcpy(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC));
+    header.format_version = DISK_FORMAT_VERSION;
+    header.library_version = SIMPLE_PREPROCESSOR_VERSION;
+    header.key_length = key.length();
+    header.output_count = output.size();
+
+    std::vector<uint64_t> offsets(output.size() + 1);
+    for (size_t i = 0; i < output.size(); i++)
+        offsets[i + 1] = offsets[i] + output[i].length();
+
+    std::string contents;
+    contents.reserve(sizeof(header) + key.length() + offsets.size() * sizeof(uint64_t) + offsets.back());
+    contents.append((const char *)&header, sizeof(header));
+    contents.append(key);
+    contents.append((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+    for (auto const& str : output)
+        contents.append(str);
+
+    return WriteAtomically(path, contents);
+}
+
+PreprocessorDiskCache::Output PreprocessorDiskCache::Map(std::string const& path, std::string_view key) const {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DiskHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    size_t length = st.st_size;
+    void *base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    auto mapped = std::make_shared<MappedOutput>(base, length);
+    const char *data = (const char *)base;
+
+    DiskHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, DISK_MAGIC, sizeof(DISK_MAGIC)) != 0 ||
+        header.format_version != DISK_FORMAT_VERSION ||
+        header.library_version != SIMPLE_PREPROCESSOR_VERSION ||
+        header.key_length != key.length())
+        return nullptr;
+
+    size_t pos = sizeof(header);
+    if (length - pos < key.length() || std::memcmp(data + pos, key.data(), key.length()) != 0)
+        return nullptr;
+    pos += key.length();
+    // output_count comes from the file, it has to be checked against the
+    // size before anything is computed or allocated from it
+    if (header.output_count >= (length - pos) / sizeof(uint64_t))
+        return nullptr;
+    size_t offsets_size = (header.output_count + 1) * sizeof(uint64_t);
+
+    const char *offsets = data + pos;
+    const char *output_data = offsets + offsets_size;
+    size_t data_length = length - pos - offsets_size;
+
+    mapped->outputs.reserve(header.output_count);
+    for (uint64_t i = 0; i < header.output_count; i++) {
+        uint64_t begin, end;
+        std::memcpy(&begin, offsets + i * sizeof(uint64_t), sizeof(uint64_t));
+        std::memcpy(&end, offsets + (i + 1) * sizeof(uint64_t), sizeof(uint64_t));
+        if (begin > end || end > data_length)
+            return nullptr;
+        mapped->outputs.emplace_back(output_data + begin, end - begin);
+    }
+
+    // bump the modification time, eviction goes by it
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return mapped;
+}
+
+PreprocessorDiskCache::Output PreprocessorDiskCache::Parse(SimplePreprocessor const& preprocessor,
+                                                           std::string_view input) {
+    // one snapshot of the defines for everything, like PreprocessorCache
+    SimplePreprocessor pinned = preprocessor;
+    std::string source_key = SourceKey(input);
+    std::string deps_path = Path(HashBytes(source_key.data(), source_key.length()), "deps");
+
+    auto MakeKey = [&](std::vector<std::string> const& names) {
+        uint32_t version = SIMPLE_PREPROCESSOR_VERSION;
+        std::string key((const char *)&version, sizeof(version));
+        key.append(source_key);
+        pinned.AppendDefineValues(names, key);
+        return key;
+    };
+
+    std::vector<std::vector<std::string>> dependency_sets = ReadDependencies(deps_path);
+    for (auto const& names : dependency_sets) {
+        std::string key = MakeKey(names);
+        Output output = Map(Path(HashBytes(key.data(), key.length()), "out"), key);
+        if (output) {
+            std::lock_guard lock(mutex);
+            hits++;
+            return output;
+        }
+    }
+
+    std::vector<std::string> dependencies;
+    std::vector<std::string> output = pinned.Parse(input.data(), input.length(), &dependencies);
+    {
+        std::lock_guard lock(mutex);
+        misses++;
+    }
+    if (output.empty())
+        return nullptr;
+
+    if (std::find(dependency_sets.begin(), dependency_sets.end(), dependencies) == dependency_sets.end()) {
+        dependency_sets.push_back(dependencies);
+        WriteDependencies(deps_path, dependency_sets);
+    }
+
+    std::string key = MakeKey(dependencies);
+    std::string path = Path(HashBytes(key.data(), key.length()), "out");
+    bool written = Write(path, key, output);
+
+    bool evict = false;
+    if (written) {
+        std::lock_guard lock(mutex);
+        writes++;
+        evict = ++writes_since_eviction >= DISK_EVICTION_INTERVAL;
+    }
+    if (evict)
+        Evict();
+
+    // serve the result the same way a hit would be served
+    Output mapped = written ? Map(path, key) : nullptr;
+    if (mapped)
+        return mapped;
+
+    // couldn't write (or it got evicted already), hand out an anonymous copy
+    return MappedOutput::Copy(output);
+}
+
+void PreprocessorDiskCache::Evict() {
+    struct File {
+        std::filesystem::path path;
+        std::filesystem::file_time_type time;
+        uint64_t size;
+    };
+    std::vector<File> results;
+    uint64_t total = 0;
+
+    std::error_code error;
+    auto stale_before = std::filesystem::file_time_type::clock::now() - DISK_STALE_TEMP_AGE;
+    std::filesystem::directory_iterator it(directory, error);
+    for (; !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+        std::filesystem::directory_entry const& entry = *it;
+        std::error_code entry_error;
+        if (!entry.is_regular_file(entry_error))
+            continue;
+        uint64_t size = entry.file_size(entry_error);
+        auto time = entry.last_write_time(entry_error);
+        if (entry_error)
+            continue;
+        if (entry.path().filename().string().find(".tmp.") != std::string::npos &&
+            time < stale_before && std::filesystem::remove(entry.path(), entry_error))
+            continue;
+        total += size;
+        if (entry.path().extension() == ".out")
+            results.push_back({ entry.path(), time, size });
+    }
+
+    uint64_t removed = 0;
+    if (total > max_bytes) {
+        // least recently used first
+        std::sort(results.begin(), results.end(),
+                  [](File const& a, File const& b) { return a.time < b.time; });
+        for (auto const& file : results) {
+            if (total <= max_bytes)
+                break;
+            if (std::filesystem::remove(file.path, error)) {
+                total -= file.size;
+                removed++;
+            }
+        }
+    }
+
+    std::lock_guard lock(mutex);
+    evictions += removed;
+    bytes = total;
+    files = results.size() - removed;
+    writes_since_eviction = 0;
+}
+
+PreprocessorDiskCache::Stats PreprocessorDiskCache::GetStats() {
+    Evict();
+    std::lock_guard lock(mutex);
+    return { hits, misses, writes, evictions, bytes, files };
+}
+
+/******************************************************************************
+ *  Shared memory cache
+ *
+ *  Segment layout:
+ *      SegmentHeader
+ *      Slot slots[slot_count] (open addressing, linear probing)
+ *      data region, from data_begin to size
+ *
+ *  A slot is free while its hash is 0. A writer claims it by swapping in the
+ *  hash of its key, then publishes the offset of its record. A claimed slot
+ *  without a record is still being written and reads as a miss.
+ *
+ *  Records (8 byte aligned, never modified once published):
+ *      RecordHeader
+ *      key bytes, padded to 8
+ *      uint64_t offsets[count + 1] (relative to the value data)
+ *      value data
+ *
+ *  Results are stored under 'O' + source key + dependent macro values, the
+ *  n-th dependency set of a source under 'D' + source key + n (the values are
+ *  the macro names).
+ ******************************************************************************/
+
+struct PreprocessorSharedCache::SegmentHeader {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t library_version;
+    uint64_t size;
+    uint64_t slot_count;
+    uint64_t data_begin;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint64_t> data_used;
+    std::atomic<uint64_t> entries;
+};
+
+struct PreprocessorSharedCache::Slot {
+    std::atomic<uint64_t> hash;
+    std::atomic<uint64_t> record;
+};
+
+struct RecordHeader {
+    uint64_t length;    // of the whole record
+    uint64_t key_length;
+    uint64_t count;
+};
+
+// Every process has to agree on these without a lock, the segment starts out
+// zeroed by ftruncate and zero is a valid value for all of them
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free);
+
+static constexpr char SHARED_MAGIC[8] = { 'S', 'P', 'P', 'S', 'H', 'M', 'E', 'M' };
+static constexpr uint32_t SHARED_FORMAT_VERSION = 1;
+static constexpr uint64_t SHARED_MIN_SIZE = 64 * 1024;
+// Give up on a key after this many slots, the segment is getting full
+static constexpr uint64_t SHARED_MAX_PROBES = 64;
+
+static inline uint64_t Align8(uint64_t value) {
+    return (value + 7) & ~(uint64_t)7;
+}
+
+static inline uint64_t KeyHash(std::string_view key) {
+    uint64_t hash = HashBytes(key.data(), key.length());
+    return hash != 0 ? hash : 1; // 0 marks a free slot
+}
+
+PreprocessorSharedCache::PreprocessorSharedCache(std::string name, uint64_t size) : name(std::move(name)) {
+    size = std::max(size, SHARED_MIN_SIZE);
+
+    bool creator = true;
+    int fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(this->name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return;
+
+    if (creator) {
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            shm_unlink(this->name.c_str());
+            return;
+        }
+    } else {
+        // the creator may not have sized it yet
+        struct stat st;
+        for (int tries = 0; ; tries++) {
+            if (fstat(fd, &st) != 0 || tries == 1000) {
+                close(fd);
+                return;
+            }
+            if ((uint64_t)st.st_size >= SHARED_MIN_SIZE)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        size = st.st_size;
+    }
+
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return;
+    SegmentHeader *segment = (SegmentHeader *)base;
+
+    if (creator) {
+        // about one slot per 256 bytes of segment, a power of two
+        uint64_t slot_count = 64;
+        while (slot_count * 2 * 256 <= size)
+            slot_count *= 2;
+        segment = new (base) SegmentHeader {};
+        std::memcpy(segment->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+        segment->format_version = SHARED_FORMAT_VERSION;
+        segment->library_version = SIMPLE_PREPROCESSOR_VERSION;
+        segment->size = size;
+        segment->slot_count = slot_count;
+        segment->data_begin = Align8(sizeof(SegmentHeader) + segment->slot_count * sizeof(Slot));
+        segment->data_used.store(segment->data_begin, std::memory_order_relaxed);
+        segment->ready.store(1, std::memory_order_release);
+    } else {
+        for (int tries = 0; segment->ready.load(std::memory_order_acquire) == 0; tries++) {
+            if (tries == 1000) {
+                munmap(base, size);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        uint64_t slot_count = segment->slot_count;
+        if (std::memcmp(segment->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) != 0 ||
+            segment->format_version != SHARED_FORMAT_VERSION ||
+            segment->library_version != SIMPLE_PREPROCESSOR_VERSION ||
+            segment->size != size || slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+            segment->data_begin < sizeof(SegmentHeader) + slot_count * sizeof(Slot) ||
+            segment->data_begin > size) {
+            munmap(base, size);
+            return;
+        }
+    }
+
+    this->header = segment;
+    this->mapped_length = size;
+}
+
+PreprocessorSharedCache::~PreprocessorSharedCache() {
+    if (header != nullptr)
+        munmap(header, mapped_length);
+}
+
+bool PreprocessorSharedCache::Remove(std::string const& name) {
+    return shm_unlink(name.c_str()) == 0;
+}
+
+bool PreprocessorSharedCache::Find(std::string_view key, std::vector<std::string_view>& out) const {
+    const char *base = (const char *)header;
+    Slot *slots = (Slot *)(base + sizeof(SegmentHeader));
+    uint64_t mask = header->slot_count - 1;
+    uint64_t hash = KeyHash(key);
+
+    for (uint64_t probe = 0; probe < SHARED_MAX_PROBES; probe++) {
+        Slot& slot = slots[(hash + probe) & mask];
+        uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+        if (slot_hash == 0)
+            return false;
+        if (slot_hash != hash)
+            continue;
+        uint64_t offset = slot.record.load(std::memory_order_acquire);
+        if (offset == 0)
+            return false; // still being written
+
+        // another process wrote it, check it stays inside the segment
+        RecordHeader record;
+        if (offset < header->data_begin || offset > mapped_length - sizeof(RecordHeader))
+            return false;
+        std::memcpy(&record, base + offset, sizeof(record));
+        uint64_t offsets_size = (record.count + 1) * sizeof(uint64_t);
+        uint64_t fixed = sizeof(RecordHeader) + Align8(record.key_length) + offsets_size;
+        if (record.length > mapped_length - offset || record.length < fixed || record.count > record.length)
+            return false;
+
+        const char *data = base + offset + sizeof(RecordHeader);
+        if (record.key_length != key.length() || std::memcmp(data, key.data(), key.length()) != 0)
+            continue; // hash collision
+
+        const char *offsets = data + Align8(record.key_length);
+        const char *values = offsets + offsets_size;
+        uint64_t values_length = record.length - fixed;
+        out.clear();
+        for (uint64_t i = 0; i < record.count; i++) {
+            uint64_t begin, end;
+            std::memcpy(&begin, offsets + i * sizeof(uint64_t), sizeof(uint64_t));
+            std::memcpy(&end, offsets + (i + 1) * sizeof(uint64_t), sizeof(uint64_t));
+            if (begin > end || end > values_length)
+                return false;
+            out.emplace_back(values + begin, end - begin);
+        }
+        return true;
+    }
+    return false;
+}
+
+PreprocessorSharedCache::InsertResult PreprocessorSharedCache::Insert(std::string_view key,
+                                                                      std::span<const std::string> values) {
+    char *base = (char *)header;
+    Slot *slots = (Slot *)(base + sizeof(SegmentHeader));
+    uint64_t mask = header->slot_count - 1;
+    uint64_t hash = KeyHash(key);
+
+    // Find the slot first, so a key that is already there costs no data
+    Slot *free_slot = nullptr;
+    for (uint64_t probe = 0; probe < SHARED_MAX_PROBES; probe++) {
+        Slot& slot = slots[(hash + probe) & mask];
+        uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+        if (slot_hash == hash)
+            return INSERT_EXISTS; // (or a collision, which we don't bother storing)
+        if (slot_hash == 0) {
+            free_slot = &slot;
+            break;
+        }
+    }
+    if (free_slot == nullptr)
+        return INSERT_FULL;
+
+    RecordHeader record;
+    record.key_length = key.length();
+    record.count = values.size();
+    uint64_t total = 0;
+    for (auto const& value : values)
+        total += value.length();
+    record.length = Align8(sizeof(RecordHeader) + Align8(key.length()) +
+                           (values.size() + 1) * sizeof(uint64_t) + total);
+
+    // Reserve the space. Whatever gets reserved past the end stays unused, the
+    // region only ever grows.
+    uint64_t offset = header->data_used.fetch_add(record.length, std::memory_order_relaxed);
+    if (offset > mapped_length || record.length > mapped_length - offset)
+        return INSERT_FULL;
+
+    char *dst = base + offset;
+    std::memcpy(dst, &record, sizeof(record));
+    dst += sizeof(record);
+    std::memcpy(dst, key.data(), key.length());
+    dst += Align8(key.length());
+    uint64_t value_offset = 0;
+    for (size_t i = 0; i <= values.size(); i++) {
+        std::memcpy(dst, &value_offset, sizeof(value_offset));
+        dst += sizeof(value_offset);
+        if (i < values.size())
+            value_offset += values[i].length();
+    }
+    for (auto const& value : values) {
+        std::memcpy(dst, value.data(), value.length());
+        dst += value.length();
+    }
+
+    // Claim the slot, if someone else took it keep probing from there
+    uint64_t index = free_slot - slots;
+    for (uint64_t probe = 0; probe < SHARED_MAX_PROBES; probe++, index = (index + 1) & mask) {
+        Slot& slot = slots[index];
+        uint64_t expected = 0;
+        if (slot.hash.compare_exchange_strong(expected, hash, std::memory_order_acq_rel)) {
+            // the release makes the record visible along with its offset
+            slot.record.store(offset, std::memory_order_release);
+            header->entries.fetch_add(1, std::memory_order_relaxed);
+            return INSERT_STORED;
+        }
+        if (expected == hash)
+            return INSERT_EXISTS; // a writer with the same key was faster
+    }
+    return INSERT_FULL;
+}
+
+PreprocessorSharedCache::Output PreprocessorSharedCache::Parse(SimplePreprocessor const& preprocessor,
+                                                               std::string_view input) {
+    // one snapshot of the defines for everything, like PreprocessorCache
+    SimplePreprocessor pinned = preprocessor;
+    if (header == nullptr) {
+        std::vector<std::string> output = pinned.Parse(input.data(), input.length());
+        return output.empty() ? nullptr : MappedOutput::Copy(output);
+    }
+
+    std::string source_key = SourceKey(input);
+    auto DependencyKey = [&](uint32_t n) {
+        std::string key = "D" + source_key;
+        key.append((const char *)&n, sizeof(n));
+        return key;
+    };
+    auto OutputKey = [&](std::span<const std::string> names) {
+        std::string key = "O" + source_key;
+        pinned.AppendDefineValues(names, key);
+        return key;
+    };
+    auto Serve = [](std::vector<std::string_view> const& views) {
+        // the views point into the segment, there is nothing to unmap
+        auto mapped = std::make_shared<MappedOutput>(nullptr, 0);
+        mapped->outputs = views;
+        return mapped;
+    };
+
+    std::vector<std::vector<std::string>> dependency_sets;
+    std::vector<std::string_view> views;
+    for (uint32_t n = 0; Find(DependencyKey(n), views); n++) {
+        std::vector<std::string> names(views.begin(), views.end());
+        if (Find(OutputKey(names), views)) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return Serve(views);
+        }
+        dependency_sets.push_back(std::move(names));
+    }
+
+    std::vector<std::string> dependencies;
+    std::vector<std::string> output = pinned.Parse(input.data(), input.length(), &dependencies);
+    misses.fetch_add(1, std::memory_order_relaxed);
+    if (output.empty())
+        return nullptr;
+
+    // Add the dependency set under the first free n, unless it's known already
+    if (std::find(dependency_sets.begin(), dependency_sets.end(), dependencies) == dependency_sets.end()) {
+        for (uint32_t n = dependency_sets.size(); ; n++) {
+            std::string key = DependencyKey(n);
+            InsertResult result = Insert(key, dependencies);
+            if (result != INSERT_EXISTS)
+                break;
+            if (Find(key, views) && std::equal(views.begin(), views.end(), dependencies.begin(), dependencies.end()))
+                break;
+        }
+    }
+
+    std::string key = OutputKey(dependencies);
+    InsertResult result = Insert(key, output);
+    if (result == INSERT_STORED)
+        writes.fetch_add(1, std::memory_order_relaxed);
+    else if (result == INSERT_FULL)
+        full.fetch_add(1, std::memory_order_relaxed);
+
+    if (result != INSERT_FULL && Find(key, views))
+        return Serve(views);
+    return MappedOutput::Copy(output);
+}
+
+PreprocessorSharedCache::Stats PreprocessorSharedCache::GetStats() const {
+    Stats stats {};
+    stats.hits = hits.load(std::memory_order_relaxed);
+    stats.misses = misses.load(std::memory_order_relaxed);
+    stats.writes = writes.load(std::memory_order_relaxed);
+    stats.full = full.load(std::memory_order_relaxed);
+    if (header != nullptr) {
+        stats.entries = header->entries.load(std::memory_order_relaxed);
+        stats.capacity = mapped_length - header->data_begin;
+        stats.bytes = std::min<uint64_t>(header->data_used.load(std::memory_order_relaxed), mapped_length) -
+                      header->data_begin;
+    }
+    return stats;
+}
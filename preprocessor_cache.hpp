@@ -0,0 +1,232 @@
+/******************************************************************************
+ *  Output cache for the simple preprocessor
+ *
+ *  Caches the outputs of SimplePreprocessor::Parse, keyed by a hash of the
+ *  input and the values of the macros the input depended on (see the
+ *  dependencies parameter of Parse). Define sets that only differ in macros
+ *  the source never looked at share the same entry.
+ *
+ *  The first parse of a source records the names of the macros it depended
+ *  on. Later lookups compute the values of those macros under the current
+ *  define set and look for an output with the same values. A source can have
+ *  more than one set of dependencies (different branches look at different
+ *  macros), every one of them is tried.
+ *
+ *  Outputs are shared and immutable, and the cache is bounded by the bytes of
+ *  the outputs it holds. The least recently used outputs are evicted first.
+ *  All the methods are thread safe, the parsing itself happens outside the lock.
+ *
+ *  PreprocessorDiskCache does the same with a directory, so the results
+ *  survive restarts and can be shared by the machines of a build farm (POSIX
+ *  only). Results are keyed by the source hash, the dependent macro values and
+ *  SIMPLE_PREPROCESSOR_VERSION, written atomically (write to a temporary file,
+ *  then rename) and served straight from mmap. The directory is trimmed to
+ *  max_bytes by deleting the results that were used least recently.
+ *
+ *  PreprocessorSharedCache keeps the results in a POSIX shared memory segment
+ *  (shm_open + mmap), so every process of a host that opens the same name sees
+ *  the results of the others as soon as they're stored, without copying them.
+ *  The segment is an open addressing index of atomic slots followed by an
+ *  append-only data region. Writers reserve their space in the data region
+ *  with an atomic add, write the record, then claim a slot with a compare and
+ *  swap and publish the record in it. Readers never lock and never see half a
+ *  record. Nothing is ever evicted: once the segment is full, new results are
+ *  simply not stored (remove the segment to start over).
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.  
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "simple_preprocessor.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Fast non-cryptographic 64 bit hash
+uint64_t HashBytes(const void *data, size_t length, uint64_t seed = 0);
+
+class PreprocessorCache {
+public:
+    using Output = std::shared_ptr<const std::vector<std::string>>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        size_t bytes;
+        size_t entries;
+    };
+
+    explicit PreprocessorCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    // Returns the output of preprocessor.Parse(input), from the cache if
+    // possible. Failed parses are not cached and return an empty output.
+    Output Parse(SimplePreprocessor const& preprocessor, std::string_view input);
+
+    Stats GetStats() const;
+    void Clear();
+
+private:
+    struct Entry {
+        std::string key;
+        Output output;
+        size_t bytes;
+    };
+    struct Source {
+        // every set of dependencies seen for this source
+        std::vector<std::vector<std::string>> dependency_sets;
+    };
+
+    void Insert(std::string key, Output output);
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Source> sources;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> entries;
+
+    size_t max_bytes;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+class PreprocessorDiskCache {
+public:
+    // A result file mapped into memory, the outputs point into the mapping
+    class MappedOutput {
+    public:
+        MappedOutput(void *base, size_t length) : base(base), length(length) {}
+        ~MappedOutput();
+        MappedOutput(MappedOutput const&) = delete;
+        MappedOutput& operator=(MappedOutput const&) = delete;
+
+        // An anonymous mapping holding a copy of output
+        static std::shared_ptr<const MappedOutput> Copy(std::vector<std::string> const& output);
+
+        size_t size() const { return outputs.size(); }
+        bool empty() const { return outputs.empty(); }
+        std::string_view operator[](size_t index) const { return outputs[index]; }
+
+    private:
+        friend class PreprocessorDiskCache;
+        friend class PreprocessorSharedCache;
+        void *base;
+        size_t length;
+        std::vector<std::string_view> outputs;
+    };
+    using Output = std::shared_ptr<const MappedOutput>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t writes;
+        uint64_t evictions;
+        uint64_t bytes; // on disk, from the last scan
+        uint64_t files;
+    };
+
+    PreprocessorDiskCache(std::string directory, uint64_t max_bytes);
+
+    // Returns the output of preprocessor.Parse(input), from disk if possible.
+    // Returns nullptr if the parse fails.
+    Output Parse(SimplePreprocessor const& preprocessor, std::string_view input);
+
+    // Scans the directory (and trims it to max_bytes). Temporary files left
+    // behind by writers that crashed are removed on the way.
+    Stats GetStats();
+    void Evict();
+
+private:
+    std::string Path(uint64_t hash, const char *extension) const;
+    std::vector<std::vector<std::string>> ReadDependencies(std::string const& path) const;
+    void WriteDependencies(std::string const& path, std::vector<std::vector<std::string>> const& sets);
+    Output Map(std::string const& path, std::string_view key) const;
+    bool WriteAtomically(std::string const& path, std::string_view contents);
+    bool Write(std::string const& path, std::string_view key, std::vector<std::string> const& output);
+
+    std::string directory;
+    uint64_t max_bytes;
+
+    std::mutex mutex;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+    uint64_t writes_since_eviction = 0;
+};
+
+class PreprocessorSharedCache {
+public:
+    // Outputs served from the segment point into it (they don't own a
+    // mapping), so they're only valid while the cache is alive
+    using MappedOutput = PreprocessorDiskCache::MappedOutput;
+    using Output = PreprocessorDiskCache::Output;
+
+    struct Stats {
+        uint64_t hits;          // of this process
+        uint64_t misses;        // of this process
+        uint64_t writes;        // of this process
+        uint64_t full;          // results this process couldn't store
+        uint64_t entries;       // in the segment, every process included
+        uint64_t bytes;         // of the data region in use
+        uint64_t capacity;      // of the data region
+    };
+
+    // Opens the segment called name (e.g. "/my_preprocessor_cache"), creating
+    // it with the given size if it doesn't exist. If it can't be opened, or it
+    // was created by an incompatible version, the cache is disabled and Parse
+    // just parses.
+    PreprocessorSharedCache(std::string name, uint64_t size);
+    ~PreprocessorSharedCache();
+    PreprocessorSharedCache(PreprocessorSharedCache const&) = delete;
+    PreprocessorSharedCache& operator=(PreprocessorSharedCache const&) = delete;
+
+    bool IsEnabled() const { return header != nullptr; }
+
+    // Returns the output of preprocessor.Parse(input), from the segment if
+    // possible. Returns nullptr if the parse fails.
+    Output Parse(SimplePreprocessor const& preprocessor, std::string_view input);
+
+    Stats GetStats() const;
+
+    // Removes the segment name. Processes that have it open keep using it.
+    static bool Remove(std::string const& name);
+
+private:
+    struct SegmentHeader;
+    struct Slot;
+    enum InsertResult { INSERT_STORED, INSERT_EXISTS, INSERT_FULL };
+
+    bool Find(std::string_view key, std::vector<std::string_view>& out) const;
+    InsertResult Insert(std::string_view key, std::span<const std::string> values);
+
+    std::string name;
+    SegmentHeader *header = nullptr;
+    size_t mapped_length = 0;
+
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
+    std::atomic<uint64_t> writes {0};
+    std::atomic<uint64_t> full {0};
+};
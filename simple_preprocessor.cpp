@@ -12,18 +12,24 @@
  *  For a copy, see <https://opensource.org/licenses/MIT>.
  ******************************************************************************/
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <stack>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <string_view>
-#include <alloca.h>
 
 #include "arithmetic_parser.hpp"
 #include "simple_preprocessor.hpp"
+#include "spsc_queue.hpp"
 
 #ifndef PARSER_NAME
 #   define PARSER_NAME "Preprocessor"
@@ -47,324 +53,1769 @@
     } while(0)
 
 
-enum Conditional : unsigned char {
-    COND_NONE = 0,
-    COND_IF,
-    COND_ELIF,
-    COND_ELSE,
-    COND_ENDIF,
+using MacroValue = std::variant<std::string_view, operand_t>;
+using MacroTable = std::unordered_map<std::string_view, MacroValue>;
+
+static void LoadDefines(SimplePreprocessor::DefineSet const& define_set, MacroTable& defines) {
+    for (auto &def : define_set) {
+        auto& value_variant = def.second;
+        if (std::holds_alternative<operand_t>(value_variant)) {
+            const operand_t *pvalue = std::get_if<operand_t>(&value_variant);
+            defines[def.first] = *pvalue;
+            continue;
+        }
+        if (std::holds_alternative<std::string>(value_variant)) {
+            const std::string *pvalue = std::get_if<std::string>(&value_variant);
+            defines[def.first] = *pvalue;
+            continue;
+        }
+        PARSER_ASSERT(false);
+    }
+}
+
+// An immutable define set, what Define publishes: a stack of layers, each with
+// its own lookup table, searched from the top. Define pushes a layer and
+// merges it with the ones below while they aren't more than twice its size,
+// like the digits of a binary counter, so n Defines copy every macro O(log n)
+// times and a lookup goes through O(log n) tables. The bottom layer of an
+// overlay shares the set it was made over, nothing is ever merged into that.
+struct DefineSnapshot {
+    SimplePreprocessor::DefineSet defines;
+    MacroTable table; // points into defines, so a snapshot never moves
+    std::shared_ptr<const DefineSnapshot> base;
+    bool overlay_bottom = false; // base is the shared set of an overlay
+
+    const MacroValue *Find(std::string_view name) const {
+        for (const DefineSnapshot *layer = this; layer != nullptr; layer = layer->base.get()) {
+            auto kv_pair = layer->table.find(name);
+            if (kv_pair != layer->table.end())
+                return &kv_pair->second;
+        }
+        return nullptr;
+    }
 };
 
-struct ParserInternal {
-    bool FindAndReplaceMacro(std::string& tmp_buffer, std::string_view line);
-    bool ParseDirective(std::string_view expr);
-    void DirectOutput(std::string_view expr);
+static std::shared_ptr<const DefineSnapshot> MakeSnapshot(SimplePreprocessor::DefineSet defines,
+                                                          std::shared_ptr<const DefineSnapshot> base,
+                                                          bool overlay_bottom = false) {
+    auto snapshot = std::make_shared<DefineSnapshot>();
+    snapshot->defines = std::move(defines);
+    snapshot->base = std::move(base);
+    snapshot->overlay_bottom = overlay_bottom;
+    LoadDefines(snapshot->defines, snapshot->table);
+    return snapshot;
+}
+
+static std::shared_ptr<const DefineSnapshot> PushLayer(std::shared_ptr<const DefineSnapshot> base,
+                                                       SimplePreprocessor::DefineSet defines) {
+    bool overlay_bottom = false;
+    while (base != nullptr && !overlay_bottom && base->defines.size() <= 2 * defines.size()) {
+        // the layer below goes first, the later defines win
+        SimplePreprocessor::DefineSet merged = base->defines;
+        merged.insert(merged.end(), std::make_move_iterator(defines.begin()),
+                      std::make_move_iterator(defines.end()));
+        defines = std::move(merged);
+        overlay_bottom = base->overlay_bottom;
+        base = base->base;
+    }
+    return MakeSnapshot(std::move(defines), std::move(base), overlay_bottom);
+}
 
-    void ParseExpression(std::string_view expr, Conditional directive);
-    inline bool TokenizeAndEvaluate(std::string_view expr) {
-        while (*expr.data() == ' ' || *expr.data() == '\t')
-            expr.remove_prefix(1);
+// The macros a run sees: the defines of a variant, if any, over a snapshot
+struct MacroScope {
+    MacroTable const *local = nullptr;
+    DefineSnapshot const *snapshot = nullptr;
 
-        std::pair<int, bool> result = EvaluateExpression(expr);
-        if (result.second == false) {
-            INTERNAL_FAIL("failed to evaluate expression %.*s", (int)expr.length(), expr.data());
-            return 0;
+    const MacroValue *Find(std::string_view name) const {
+        if (local != nullptr) {
+            auto kv_pair = local->find(name);
+            if (kv_pair != local->end())
+                return &kv_pair->second;
         }
-        return result.first != 0;
+        return snapshot->Find(name);
     }
+};
 
-    std::unordered_map<std::string_view, std::variant<std::string_view, int>> defines;
-    unsigned int current_output_idx = 0;
-    // unsigned int expected_outputs;
+static void AppendMacroValue(std::string& out, MacroValue const& value_var) {
+    if (std::holds_alternative<operand_t>(value_var)) {
+        const operand_t *pvalue = std::get_if<operand_t>(&value_var);
+
+        char value_buf[24];
+        auto [value_end, error] = std::to_chars(value_buf, value_buf + sizeof(value_buf), *pvalue);
+        PARSER_ASSERT(error == std::errc());
+
+        out.append(value_buf, value_end - value_buf);
+    } else if (std::holds_alternative<std::string_view>(value_var)) {
+        const std::string_view *pvalue = std::get_if<std::string_view>(&value_var);
+
+        out.append(pvalue->data(), pvalue->length());
+    } else {
+        PARSER_ASSERT(false); // something went very wrong if this triggers
+    }
+}
+
+constexpr bool MaybePartOfWord(char c) {
+    return ('0' <= c && c <= '9') ||
+           ('a' <= c && c <= 'z') ||
+           ('A' <= c && c <= 'Z') ||
+           c == '_';
+}
+
+static inline std::string_view SkipSpaces(std::string_view expr) {
+    while (!expr.empty() && (expr[0] == ' ' || expr[0] == '\t'))
+        expr.remove_prefix(1);
+    return expr;
+}
+
+enum DirectiveResult : unsigned char {
+    DIRECTIVE_OK = 0,
+    DIRECTIVE_UNKNOWN,
+    DIRECTIVE_NO_VALUE,
+};
+
+// Figures out which directive the row (starting with the prefix) is and what
+// its argument is.
+static DirectiveResult ClassifyDirective(std::string_view row, CompiledSource::NodeKind& kind,
+                                         std::string_view& argument) {
+    std::string_view expr = row;
+    expr.remove_prefix(1); // '#'
+
+    // get rid of spaces inbetween the prefix and the expression
+    expr = SkipSpaces(expr);
+
+    struct Keyword {
+        std::string_view name;
+        CompiledSource::NodeKind kind;
+        bool needs_value;
+    };
+    static constexpr Keyword keywords[] = {
+        { "if",     CompiledSource::NODE_IF,     true  },
+        { "elif",   CompiledSource::NODE_ELIF,   true  },
+        // TODO: ensure there are no extra tokens after the directive
+        { "output", CompiledSource::NODE_OUTPUT, true  },
+        { "else",   CompiledSource::NODE_ELSE,   false },
+        { "endif",  CompiledSource::NODE_ENDIF,  false },
+    };
+
+    for (auto const& keyword : keywords) {
+        if (expr.compare(0, keyword.name.length(), keyword.name) != 0)
+            continue;
+        expr.remove_prefix(keyword.name.length());
+        if (keyword.needs_value && (expr.empty() || expr[0] != ' '))
+            return DIRECTIVE_NO_VALUE;
+        kind = keyword.kind;
+        argument = expr;
+        return DIRECTIVE_OK;
+    }
+    return DIRECTIVE_UNKNOWN;
+}
+
+// Like INTERNAL_FAIL, unless the compiler is quiet
+#define COMPILE_FAIL(msg, ...)                      \
+    do {                                            \
+        if (!this->quiet)                           \
+            INTERNAL_LOG(msg, ##__VA_ARGS__);       \
+        this->failed = true;                        \
+    } while(0)
 
-    struct ConditionalBranch {
-        bool result;
-        bool consumed;
-        bool in_true_loop;
-        Conditional cond;
+struct SourceCompiler {
+    CompiledSource& out;
+    const char *text;   // offsets are relative to it, usually out.text
+    std::unordered_map<std::string_view, uint32_t> symbol_ids;
+
+    // Set when compiling one chunk of a larger text (see CompileSource with
+    // threads and ParseStream): branches closing a conditional opened before
+    // the chunk are kept in unmatched, and conditionals may still be open at
+    // the end. A quiet compiler logs nothing, any error just fails it.
+    bool chunk {false};
+    bool quiet {false};
+    std::vector<uint32_t> unmatched;
+
+    // open conditionals: the if node and the last branch seen
+    struct OpenConditional {
+        uint32_t if_node;
+        uint32_t last_branch;
     };
-    std::stack<ConditionalBranch> condition;
+    std::vector<OpenConditional> open;
 
     unsigned int current_line {0};
     bool failed  {false};
+
+    SourceCompiler(CompiledSource& out, const char *text) : out(out), text(text) {}
+
+    void AddWords(CompiledSource::Node& node, std::string_view view);
+    void AddText(std::string_view row_with_newline);
+    void AddDirective(CompiledSource::NodeKind kind, std::string_view argument);
+    void Link(CompiledSource::NodeKind kind, uint32_t index);
+    void Compile(std::string_view range);
 };
 
-void ParserInternal::ParseExpression(std::string_view expr, Conditional eval) {
-    bool curr_result = false;
-    bool consumed = false;
-    bool prev_result = true;
-    bool in_true_loop = true;
-    Conditional prev_cond = COND_NONE;
+// Records the words of view (which points into text) for replacement
+void SourceCompiler::AddWords(CompiledSource::Node& node, std::string_view view) {
+    size_t pos = 0;
+    while (pos < view.length()) {
+        if (!MaybePartOfWord(view[pos])) {
+            pos++;
+            continue;
+        }
+        size_t start = pos;
+        while (pos < view.length() && MaybePartOfWord(view[pos]))
+            pos++;
+        if (view[start] >= '0' && view[start] <= '9')
+            continue; // numbers can't be macros
+
+        std::string_view word = view.substr(start, pos - start);
+        auto [it, inserted] = symbol_ids.try_emplace(word, (uint32_t)out.symbol_offsets.size() - 1);
+        if (inserted) {
+            out.symbol_names.append(word);
+            out.symbol_offsets.push_back((uint32_t)out.symbol_names.length());
+        }
+        out.words.push_back({ (uint32_t)(word.data() - text), (uint32_t)word.length(), it->second });
+    }
+    node.last_word = (uint32_t)out.words.size();
+}
 
-    if (!condition.empty()) {
-        prev_result = condition.top().result;
-        consumed = condition.top().consumed;
-        in_true_loop = condition.top().in_true_loop;
-        prev_cond = condition.top().cond;
+void SourceCompiler::AddText(std::string_view row) {
+    uint32_t begin = (uint32_t)(row.data() - text);
+
+    // extend the previous text node if it ends right where this row starts
+    if (out.nodes.empty() || out.nodes.back().kind != CompiledSource::NODE_TEXT ||
+        out.nodes.back().end != begin) {
+        CompiledSource::Node node {};
+        node.kind = CompiledSource::NODE_TEXT;
+        node.line = current_line;
+        node.begin = begin;
+        node.first_word = node.last_word = (uint32_t)out.words.size();
+        out.nodes.push_back(node);
     }
-    bool in_nested_loop = !condition.empty();
 
-    switch (eval) {
-    case COND_IF:
-        curr_result = TokenizeAndEvaluate(expr);
-        condition.push({ curr_result, curr_result, in_true_loop && prev_result, COND_IF });
-        break;
+    CompiledSource::Node& node = out.nodes.back();
+    node.end = begin + (uint32_t)row.length();
+    AddWords(node, row);
+}
 
-    case COND_ELIF:
-        if (prev_cond == COND_ELSE) { INTERNAL_FAIL("elif after else"); break; }
-        if (!in_nested_loop)        { INTERNAL_FAIL("elif without if"); break; }
+void SourceCompiler::AddDirective(CompiledSource::NodeKind kind, std::string_view argument) {
+    CompiledSource::Node node {};
+    node.kind = kind;
+    node.line = current_line;
+    node.begin = (uint32_t)(argument.data() - text);
+    node.end = node.begin + (uint32_t)argument.length();
+    node.first_word = node.last_word = (uint32_t)out.words.size();
+    node.next = node.endif = UINT32_MAX; // until the conditional is closed
+    uint32_t index = (uint32_t)out.nodes.size();
+
+    if (kind != CompiledSource::NODE_OUTPUT) {
+        if (chunk && kind != CompiledSource::NODE_IF && open.empty())
+            unmatched.push_back(index); // for whoever stitches the chunks together
+        else
+            Link(kind, index);
+        if (failed)
+            return;
+    }
 
-        curr_result = TokenizeAndEvaluate(expr);
-        condition.top().result = (!consumed && curr_result) && in_true_loop;
-        condition.top().consumed = (consumed || curr_result);
-        condition.top().cond = COND_ELIF;
+    if (kind == CompiledSource::NODE_IF || kind == CompiledSource::NODE_ELIF ||
+        kind == CompiledSource::NODE_OUTPUT)
+        AddWords(node, argument);
+
+    if (kind == CompiledSource::NODE_IF || kind == CompiledSource::NODE_ELIF) {
+        // Expressions that don't compile might still be valid once their
+        // macros are replaced, so they are left for the runner to evaluate as text.
+        CompiledExpression expr;
+        node.code_begin = node.code_end = (uint32_t)out.code.size();
+        if (CompileExpression(argument, expr)) {
+            for (auto instr : expr.code) {
+                if (instr.opcode == EXPR_SYMBOL)
+                    instr.symbol = symbol_ids.at(expr.symbols[instr.symbol]);
+                out.code.push_back(instr);
+            }
+            node.code_end = (uint32_t)out.code.size();
+        }
+    }
 
-        break;
+    out.nodes.push_back(node);
+}
 
-    case COND_ELSE:
-        if (prev_cond == COND_ELSE) { INTERNAL_FAIL("else after else"); break; }
-        if (!in_nested_loop)        { INTERNAL_FAIL("else without if"); break; }
+// Links the branch at index (not in out.nodes yet) into the open conditionals
+void SourceCompiler::Link(CompiledSource::NodeKind kind, uint32_t index) {
+    if (kind == CompiledSource::NODE_IF) {
+        open.push_back({ index, index });
+        return;
+    }
 
-        condition.top().result = !consumed && in_true_loop;
-        condition.top().consumed = true;
-        condition.top().cond = COND_ELSE;
+    const char *name = kind == CompiledSource::NODE_ELIF ? "elif" :
+                       kind == CompiledSource::NODE_ELSE ? "else" : "endif";
+    if (open.empty()) {
+        COMPILE_FAIL("%s without if", name);
+        return;
+    }
+    CompiledSource::Node& last = out.nodes[open.back().last_branch];
+    if (last.kind == CompiledSource::NODE_ELSE && kind != CompiledSource::NODE_ENDIF) {
+        COMPILE_FAIL("%s after else", name);
+        return;
+    }
+    last.next = index;
+    open.back().last_branch = index;
+
+    if (kind == CompiledSource::NODE_ENDIF) {
+        // let every branch know where the conditional ends
+        for (uint32_t branch = open.back().if_node; branch != index; branch = out.nodes[branch].next)
+            out.nodes[branch].endif = index;
+        open.pop_back();
+    }
+}
 
-        break;
+void SourceCompiler::Compile(std::string_view range) {
+    std::string_view input_view = range;
 
-    case COND_ENDIF:
-        if (!in_nested_loop)        { INTERNAL_FAIL("endif without if"); break; }
-        PARSER_ASSERT(prev_cond != COND_ENDIF); // endif always pops
+    while (!input_view.empty() && !failed) {
+        current_line += 1;
 
-        condition.pop();
-        break;
+        size_t next_pos = input_view.find('\n');
+        PARSER_ASSERT(next_pos != std::string_view::npos);
+        std::string_view row = input_view.substr(0, next_pos);
+
+        CompiledSource::NodeKind kind;
+        std::string_view argument;
+        DirectiveResult directive = DIRECTIVE_UNKNOWN;
+        if (!row.empty() && row[0] == _PFX)
+            directive = ClassifyDirective(row, kind, argument);
+
+        switch (directive) {
+        case DIRECTIVE_OK:
+            AddDirective(kind, argument);
+            break;
+        case DIRECTIVE_NO_VALUE:
+            COMPILE_FAIL("expected value in directive");
+            break;
+        case DIRECTIVE_UNKNOWN:
+#if defined(PARSER_IGNORE_UNKNOWN_DIRECTIVE)
+            AddText(input_view.substr(0, next_pos + 1));
+#else
+            if (row.empty() || row[0] != _PFX)
+                AddText(input_view.substr(0, next_pos + 1));
+            else if (quiet)
+                failed = true; // so the message comes out of the sequential compile
+            else
+                INTERNAL_LOG("unknown directive in %.*s", (int)row.length(), row.data());
+#endif
+            break;
+        }
+
+        input_view.remove_prefix(next_pos + 1);
+    }
+
+    if (!failed && !open.empty() && !chunk) {
+        PARSER_LOG(PARSER_NAME": unterminated conditional directive");
+        failed = true;
+    }
+}
+
+// The text gets a newline if it lacks one, and its offsets have to fit, with
+// UINT32_MAX left free for the index of a missing node
+static bool FitsCompiledSource(std::string_view source) {
+    if (source.length() <= COMPILED_SOURCE_MAX_LENGTH)
+        return true;
+    PARSER_LOG(PARSER_NAME": the input is too large (%zu bytes, at most %zu)",
+               source.length(), COMPILED_SOURCE_MAX_LENGTH);
+    return false;
+}
+
+bool CompileSource(std::string_view source, CompiledSource& out) {
+    if (!FitsCompiledSource(source)) {
+        out = {};
+        return false;
+    }
 
-    default:
-        INTERNAL_FAIL("Conditional logic error (should not happen)");
-        break;
+    // cleared rather than replaced, so a reused CompiledSource keeps its buffers
+    out.text.clear();
+    out.nodes.clear();
+    out.words.clear();
+    out.symbol_names.clear();
+    out.symbol_offsets.assign(1, 0);
+    out.code.clear();
+    out.text.reserve(source.length() + 1);
+    out.text.assign(source);
+    if (out.text.empty() || out.text.back() != '\n')
+        out.text.push_back('\n');
+
+    SourceCompiler compiler(out, out.text.data());
+    compiler.Compile(out.text);
+    if (compiler.failed) {
+        out = {};
+        return false;
     }
+    return true;
 }
 
-void ParserInternal::DirectOutput(std::string_view expr) {
+// Chunks smaller than this aren't worth a thread
+static constexpr size_t PARALLEL_MIN_CHUNK = 1 << 20;
+
+bool CompileSource(std::string_view source, CompiledSource& out, unsigned int threads) {
+    // the stitched chunks keep the same 32 bit offsets
+    if (!FitsCompiledSource(source)) {
+        out = {};
+        return false;
+    }
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunk_count = std::min<size_t>(threads, source.length() / PARALLEL_MIN_CHUNK);
+    if (chunk_count <= 1)
+        return CompileSource(source, out);
+
+    out.text.clear();
+    out.nodes.clear();
+    out.words.clear();
+    out.symbol_names.clear();
+    out.symbol_offsets.assign(1, 0);
+    out.code.clear();
+    out.text.reserve(source.length() + 1);
+    out.text.assign(source);
+    if (out.text.back() != '\n')
+        out.text.push_back('\n');
+
+    // line aligned chunks of about the same size
+    std::string_view text = out.text;
+    std::vector<std::string_view> ranges;
+    size_t begin = 0;
+    for (size_t c = 1; c <= chunk_count && begin < text.length(); c++) {
+        size_t end = c == chunk_count ? text.length() : text.find('\n', text.length() * c / chunk_count);
+        end = end == std::string_view::npos ? text.length() : std::max(end + 1, begin);
+        if (end > begin)
+            ranges.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+
+    // Every chunk is compiled on its own, with its own symbols
+    struct Chunk {
+        CompiledSource partial;
+        std::unique_ptr<SourceCompiler> compiler;
+    };
+    std::vector<Chunk> chunks(ranges.size());
+    auto CompileChunk = [&](size_t c) {
+        chunks[c].compiler = std::make_unique<SourceCompiler>(chunks[c].partial, text.data());
+        chunks[c].compiler->chunk = true;
+        chunks[c].compiler->quiet = true;
+        chunks[c].compiler->Compile(ranges[c]);
+    };
+    std::vector<std::thread> workers;
+    for (size_t c = 1; c < chunks.size(); c++)
+        workers.emplace_back(CompileChunk, c);
+    CompileChunk(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    // Then stitched together in order: symbols get their global ids, indices
+    // are rebased, and the branches that close conditionals of earlier
+    // chunks are linked like the sequential compile would have.
+    SourceCompiler global(out, text.data());
+    global.chunk = true;
+    global.quiet = true;
+    uint32_t line_base = 0;
+    std::vector<uint32_t> symbol_map;
+    for (auto& chunk : chunks) {
+        SourceCompiler& compiler = *chunk.compiler;
+        CompiledSource& partial = chunk.partial;
+        if (compiler.failed)
+            break;
+
+        // the name of a local symbol is the text of its first word
+        symbol_map.assign(partial.symbol_offsets.size() - 1, UINT32_MAX);
+        for (auto const& word : partial.words) {
+            if (symbol_map[word.symbol] != UINT32_MAX)
+                continue;
+            std::string_view name = text.substr(word.offset, word.length);
+            auto [it, inserted] = global.symbol_ids.try_emplace(name, (uint32_t)out.symbol_offsets.size() - 1);
+            if (inserted) {
+                out.symbol_names.append(name);
+                out.symbol_offsets.push_back((uint32_t)out.symbol_names.length());
+            }
+            symbol_map[word.symbol] = it->second;
+        }
+
+        uint32_t word_base = (uint32_t)out.words.size();
+        for (auto word : partial.words) {
+            word.symbol = symbol_map[word.symbol];
+            out.words.push_back(word);
+        }
+        uint32_t code_base = (uint32_t)out.code.size();
+        for (auto instr : partial.code) {
+            if (instr.opcode == EXPR_SYMBOL)
+                instr.symbol = symbol_map[instr.symbol];
+            out.code.push_back(instr);
+        }
+
+        // a text node split by the chunk boundary becomes one again
+        bool merged = !out.nodes.empty() && !partial.nodes.empty() &&
+                      out.nodes.back().kind == CompiledSource::NODE_TEXT &&
+                      partial.nodes[0].kind == CompiledSource::NODE_TEXT &&
+                      out.nodes.back().end == partial.nodes[0].begin;
+        uint32_t node_base = (uint32_t)out.nodes.size() - merged;
+        auto Rebase = [&](uint32_t index) { return index == UINT32_MAX ? index : index + node_base; };
+
+        for (size_t i = 0; i < partial.nodes.size(); i++) {
+            CompiledSource::Node node = partial.nodes[i];
+            node.line += line_base;
+            node.first_word += word_base;
+            node.last_word += word_base;
+            if (node.kind == CompiledSource::NODE_IF || node.kind == CompiledSource::NODE_ELIF) {
+                node.code_begin += code_base;
+                node.code_end += code_base;
+            }
+            if (node.kind != CompiledSource::NODE_TEXT) {
+                node.next = Rebase(node.next);
+                node.endif = Rebase(node.endif);
+            }
+            if (i == 0 && merged) {
+                out.nodes.back().end = node.end;
+                out.nodes.back().last_word = node.last_word;
+            } else {
+                out.nodes.push_back(node);
+            }
+        }
+
+        for (uint32_t index : compiler.unmatched) {
+            global.Link(out.nodes[index + node_base].kind, index + node_base);
+            if (global.failed)
+                break;
+        }
+        if (global.failed)
+            break;
+        for (auto const& open : compiler.open)
+            global.open.push_back({ open.if_node + node_base, open.last_branch + node_base });
+        line_base += compiler.current_line;
+    }
+
+    // Anything wrong: the sequential compile finds the same problem and
+    // reports it properly
+    bool failed = global.failed || !global.open.empty();
+    for (auto const& chunk : chunks)
+        failed = failed || chunk.compiler->failed;
+    if (failed)
+        return CompileSource(source, out);
+    return true;
+}
+
+// Runs a compiled source against a define set
+struct SourceRunner {
+    CompiledSourceView source;
+    MacroScope defines;
+
+    // macros are looked up the first time a symbol is reached, which only
+    // happens in active text and evaluated directives
+    std::vector<const MacroValue *> macros;
+    std::vector<operand_t> values;
+    std::vector<bool> resolved;
+
+    // When set, the run only records its decisions here instead of building
+    // the output: the branch taken by every conditional, every output index
+    // and the value of every macro replaced in text (the first time it is).
+    // Runs with the same signature produce the same output.
+    std::string *signature = nullptr;
+    std::vector<bool> recorded;
+
+    // Used by EnumerateVariants: symbols with a domain (symbol_domain >= 0)
+    // take their value from the current subset of that domain. Reaching one
+    // whose subset still has more than one value stops the run and asks for
+    // the subset to be split into parts.
+    const std::vector<int> *symbol_domain = nullptr;
+    const std::vector<std::vector<operand_t>> *subsets = nullptr;
+    std::vector<MacroValue> domain_macros;
+    int split_domain = -1;
+    std::vector<std::vector<operand_t>> split_parts;
+
+    bool IsUndecided(uint32_t symbol) const {
+        return symbol_domain && !resolved[symbol] && (*symbol_domain)[symbol] >= 0 &&
+               (*subsets)[(*symbol_domain)[symbol]].size() > 1;
+    }
+    void RequestSplit(int domain, std::vector<std::vector<operand_t>> parts) {
+        split_domain = domain;
+        split_parts = std::move(parts);
+        failed = true;
+    }
+
+    // When set, text nodes are recorded as pieces of pieces[output index]
+    // instead of being appended to the output, see ParseVariantsDelta. The
+    // text of nodes with words is replaced into piece_text, and the offset
+    // of their piece is relative to it.
+    using Piece = SimplePreprocessor::VariantOutputs::Piece;
+    std::vector<std::vector<Piece>> *pieces = nullptr;
+    std::string piece_text;
+
+    void AddPiece(uint32_t index, CompiledSource::Node const& node) {
+        if (current_output_idx >= pieces->size())
+            pieces->resize(current_output_idx + 1);
+        if (node.first_word == node.last_word) {
+            (*pieces)[current_output_idx].push_back({ index, node.begin, node.end - node.begin });
+            return;
+        }
+        size_t offset = piece_text.length();
+        AppendReplaced(node, piece_text);
+        (*pieces)[current_output_idx].push_back({ index, (uint32_t)offset, (uint32_t)(piece_text.length() - offset) });
+    }
+
+    // When set, the active text nodes are only listed here with their output
+    // index, and their macros resolved, so they can be replaced later from
+    // several threads at once (see ParseParallel)
+    struct ActiveText {
+        uint32_t node;
+        uint32_t output;
+    };
+    std::vector<ActiveText> *plan = nullptr;
+
+    void AddToPlan(uint32_t index, CompiledSource::Node const& node) {
+        plan->push_back({ index, current_output_idx });
+        for (uint32_t w = node.first_word; w < node.last_word; w++)
+            Resolve(source.words[w].symbol);
+    }
+
+    std::string tmp_buf;
+    unsigned int current_output_idx = 0;
+    unsigned int current_line {0};
+    bool failed  {false};
+
+    SourceRunner(CompiledSourceView source, MacroScope defines) :
+        source(source), defines(defines),
+        macros(source.SymbolCount()), values(source.SymbolCount()), resolved(source.SymbolCount()) {}
+
+    void RecordValue(uint32_t value) {
+        signature->append((const char *)&value, sizeof(value));
+    }
+    void RecordWords(CompiledSource::Node const& node) {
+        for (uint32_t w = node.first_word; w < node.last_word; w++) {
+            uint32_t symbol = source.words[w].symbol;
+            if (recorded[symbol])
+                continue;
+            recorded[symbol] = true;
+            // Every new symbol gets an entry, undefined ones included, and a
+            // value is preceded by its length: string macros can hold any
+            // byte, nothing in a value may pass for the entries after it
+            const MacroValue *macro = Resolve(symbol);
+            RecordValue(symbol);
+            if (macro == nullptr) {
+                signature->push_back('\0');
+                continue;
+            }
+            signature->push_back('\1');
+            size_t length_pos = signature->length();
+            signature->append(sizeof(uint64_t), '\0');
+            AppendMacroValue(*signature, *macro);
+            uint64_t length = signature->length() - length_pos - sizeof(uint64_t);
+            std::memcpy(signature->data() + length_pos, &length, sizeof(length));
+        }
+    }
+
+    const MacroValue *Resolve(uint32_t symbol) {
+        if (!resolved[symbol] && symbol_domain && (*symbol_domain)[symbol] >= 0) {
+            int domain = (*symbol_domain)[symbol];
+            auto const& subset = (*subsets)[domain];
+            if (subset.size() != 1) {
+                // every value on its own
+                std::vector<std::vector<operand_t>> parts;
+                for (operand_t value : subset)
+                    parts.push_back({ value });
+                RequestSplit(domain, std::move(parts));
+                return nullptr;
+            }
+            resolved[symbol] = true;
+            domain_macros.resize(source.SymbolCount());
+            domain_macros[symbol] = subset[0];
+            macros[symbol] = &domain_macros[symbol];
+            values[symbol] = subset[0];
+        }
+        if (!resolved[symbol]) {
+            resolved[symbol] = true;
+            macros[symbol] = defines.Find(source.Symbol(symbol));
+            if (macros[symbol] != nullptr) {
+                if (const operand_t *pvalue = std::get_if<operand_t>(macros[symbol]))
+                    values[symbol] = *pvalue;
+            }
+        }
+        return macros[symbol];
+    }
+
+    // Appends the node's text with its macros replaced
+    void AppendReplaced(CompiledSource::Node const& node, std::string& out) {
+        const char *text = source.text.data();
+        const char *copied_until = text + node.begin;
+
+        for (uint32_t w = node.first_word; w < node.last_word; w++) {
+            CompiledSource::Word const& word = source.words[w];
+            const MacroValue *macro = Resolve(word.symbol);
+            if (macro == nullptr)
+                continue;
+            out.append(copied_until, text + word.offset - copied_until);
+            AppendMacroValue(out, *macro);
+            copied_until = text + word.offset + word.length;
+        }
+        out.append(copied_until, text + node.end - copied_until);
+    }
+
+    // Every symbol that was resolved is a macro the output depends on
+    void CollectDependencies(std::vector<std::string>& dependencies) const {
+        dependencies.clear();
+        for (size_t symbol = 0; symbol < resolved.size(); symbol++) {
+            if (resolved[symbol])
+                dependencies.emplace_back(source.Symbol(symbol));
+        }
+        std::sort(dependencies.begin(), dependencies.end());
+    }
+
+    bool EvaluateCondition(CompiledSource::Node const& node);
+    void DirectOutput(CompiledSource::Node const& node, std::vector<std::string>& result);
+    void Run(std::vector<std::string>& result);
+    void RunSignature(std::string& out);
+
+    // For sources that arrive in pieces (ParseStream): every piece is run on
+    // its own, in order, without the jumps (they may lead outside the piece).
+    // The conditionals still open are carried from one piece to the next.
+    struct OpenBranch {
+        bool parent_active;
+        bool taken;         // a branch of this conditional was (or can't be) taken
+        bool active;
+        bool seen_else;
+    };
+    void RunPiece(std::vector<OpenBranch>& open, std::vector<OutputSegment>& segments);
+};
+
+void SourceRunner::RunPiece(std::vector<OpenBranch>& open, std::vector<OutputSegment>& segments) {
+    std::vector<std::string> unused;
+
+    for (uint32_t i = 0; i < source.nodes.size() && !failed; i++) {
+        CompiledSource::Node const& node = source.nodes[i];
+        bool active = open.empty() || open.back().active;
+        current_line = node.line;
+
+        switch (node.kind) {
+        case CompiledSource::NODE_TEXT:
+            if (!active)
+                break;
+            if (segments.empty() || segments.back().output != current_output_idx)
+                segments.push_back({ current_output_idx, {} });
+            if (node.first_word == node.last_word)
+                segments.back().text.append(source.text.data() + node.begin, node.end - node.begin);
+            else
+                AppendReplaced(node, segments.back().text);
+            break;
+
+        case CompiledSource::NODE_OUTPUT:
+            if (active)
+                DirectOutput(node, unused);
+            unused.clear();
+            break;
+
+        case CompiledSource::NODE_IF:
+            if (active) {
+                bool result = EvaluateCondition(node);
+                open.push_back({ true, result, result, false });
+            } else {
+                open.push_back({ false, true, false, false });
+            }
+            break;
+
+        case CompiledSource::NODE_ELIF:
+        case CompiledSource::NODE_ELSE: {
+            const char *name = node.kind == CompiledSource::NODE_ELIF ? "elif" : "else";
+            if (open.empty()) {
+                INTERNAL_FAIL("%s without if", name);
+                break;
+            }
+            OpenBranch& branch = open.back();
+            if (branch.seen_else) {
+                INTERNAL_FAIL("%s after else", name);
+                break;
+            }
+            if (!branch.parent_active || branch.taken) {
+                branch.active = false;
+            } else {
+                branch.active = node.kind == CompiledSource::NODE_ELSE || EvaluateCondition(node);
+                branch.taken = branch.active;
+            }
+            branch.seen_else = node.kind == CompiledSource::NODE_ELSE;
+        } break;
+
+        case CompiledSource::NODE_ENDIF:
+            if (open.empty()) {
+                INTERNAL_FAIL("endif without if");
+                break;
+            }
+            open.pop_back();
+            break;
+        }
+    }
+}
+
+void SourceRunner::RunSignature(std::string& out) {
+    out.clear();
+    signature = &out;
+    recorded.assign(source.SymbolCount(), false);
+    std::vector<std::string> unused;
+    Run(unused);
+    signature = nullptr;
+}
+
+bool SourceRunner::EvaluateCondition(CompiledSource::Node const& node) {
+    current_line = node.line;
+
+    if (symbol_domain) {
+        // Undecided domain symbols: if there is only one, its values are
+        // split by the result of the expression instead of one by one.
+        int undecided = -1;
+        bool several = false;
+        for (uint32_t w = node.first_word; w < node.last_word; w++) {
+            uint32_t symbol = source.words[w].symbol;
+            if (!IsUndecided(symbol) || (int)symbol == undecided)
+                continue;
+            several = undecided >= 0;
+            undecided = symbol;
+        }
+        if (undecided >= 0) {
+            bool compiled = !several && node.code_begin != node.code_end;
+            for (uint32_t w = node.first_word; w < node.last_word && compiled; w++) {
+                uint32_t symbol = source.words[w].symbol;
+                if ((int)symbol == undecided)
+                    continue;
+                const MacroValue *macro = Resolve(symbol);
+                if (macro != nullptr && std::holds_alternative<std::string_view>(*macro))
+                    compiled = false;
+            }
+            if (!compiled) {
+                failed = false;
+                split_domain = -1;
+                Resolve(undecided); // one by one
+                return false;
+            }
+
+            // parts: false, true, failed
+            int domain = (*symbol_domain)[undecided];
+            std::vector<std::vector<operand_t>> parts(3);
+            for (operand_t value : (*subsets)[domain]) {
+                values[undecided] = value;
+                auto result = EvaluateCompiled(source.code.data() + node.code_begin,
+                                               node.code_end - node.code_begin, values.data());
+                parts[!result.second ? 2 : result.first != 0].push_back(value);
+            }
+            values[undecided] = 0;
+
+            // Same decision for every value: nothing to split (yet)
+            for (int decision = 0; decision < 3; decision++) {
+                if (parts[decision].size() != (*subsets)[domain].size())
+                    continue;
+                if (decision == 2) {
+                    std::string_view expr = SkipSpaces({ source.text.data() + node.begin, node.end - node.begin });
+                    INTERNAL_FAIL("failed to evaluate expression %.*s", (int)expr.length(), expr.data());
+                }
+                return decision == 1;
+            }
+            std::erase_if(parts, [](auto const& part) { return part.empty(); });
+            RequestSplit(domain, std::move(parts));
+            return false;
+        }
+    }
+
+    // String macros are replaced as text (they might be whole expressions),
+    // everything else can use the compiled expression.
+    bool as_text = node.code_begin == node.code_end;
+    for (uint32_t w = node.first_word; w < node.last_word; w++) {
+        const MacroValue *macro = Resolve(source.words[w].symbol);
+        if (macro != nullptr && std::holds_alternative<std::string_view>(*macro))
+            as_text = true;
+    }
+
+    std::pair<operand_t, bool> result;
+    std::string_view expr;
+    if (!as_text) {
+        result = EvaluateCompiled(source.code.data() + node.code_begin,
+                                  node.code_end - node.code_begin, values.data());
+    } else {
+        tmp_buf.clear();
+        AppendReplaced(node, tmp_buf);
+        expr = SkipSpaces(tmp_buf);
+        result = EvaluateExpression(expr);
+    }
+
+    if (result.second == false) {
+        if (!as_text)
+            expr = SkipSpaces({ source.text.data() + node.begin, node.end - node.begin });
+        INTERNAL_FAIL("failed to evaluate expression %.*s", (int)expr.length(), expr.data());
+        return false;
+    }
+    return result.first != 0;
+}
+
+void SourceRunner::DirectOutput(CompiledSource::Node const& node, std::vector<std::string>& result) {
+    current_line = node.line;
+
+    tmp_buf.clear();
+    AppendReplaced(node, tmp_buf);
     // TODO: this will fail if there are spaces after the index.
-    while (*expr.data() == ' ' || *expr.data() == '\t')
-        expr.remove_prefix(1);
+    std::string_view expr = SkipSpaces(tmp_buf);
 
-    char *verify_length;
-    int number = std::strtol(expr.data(), &verify_length, 10);
-    if (verify_length != expr.data() + expr.length()) {
+    unsigned int number = 0;
+    auto [end, error] = std::from_chars(expr.data(), expr.data() + expr.length(), number, 10);
+    if (error != std::errc() || end != expr.data() + expr.length()) {
         INTERNAL_FAIL("expected index in output directive");
         return;
     }
 
     // TODO: Limit max number of outputs to one specified by the user
     this->current_output_idx = number;
+    if (signature)
+        RecordValue(number);
+    // NOTE: This is dirty. If (hypothetically) the indices we're getting from
+    // the file are 0 and 14, we're going to have 15 strings, out of which 13
+    // are unused.
+    // TODO: Allow the user to specify the amount of outputs expected and handle
+    // cases where the file declares more than that
+    if (number >= result.size())
+        result.resize(number + 1);
 }
 
-bool ParserInternal::ParseDirective(std::string_view expr) {
-    expr.remove_prefix(1); // '#'
+void SourceRunner::Run(std::vector<std::string>& result) {
+    auto const& nodes = source.nodes;
+    result.resize(1);
+
+    uint32_t i = 0;
+    while (i < nodes.size() && !failed) {
+        CompiledSource::Node const& node = nodes[i];
+        switch (node.kind) {
+        case CompiledSource::NODE_TEXT:
+            if (signature)
+                RecordWords(node);
+            else if (pieces)
+                AddPiece(i, node);
+            else if (plan)
+                AddToPlan(i, node);
+            else if (node.first_word == node.last_word)
+                result[current_output_idx].append(source.text.data() + node.begin, node.end - node.begin);
+            else
+                AppendReplaced(node, result[current_output_idx]);
+            i++;
+            break;
 
-    // get rid of spaces inbetween the prefix and the expression
-    while (*expr.data() == ' ' || *expr.data() == '\t')
-        expr.remove_prefix(1);
+        case CompiledSource::NODE_OUTPUT:
+            DirectOutput(node, result);
+            i++;
+            break;
 
-    if (expr.compare(0, 2, "if") == 0) {
-        expr.remove_prefix(2);
-        if (*expr.data() != ' ')
-            goto no_value;
-        ParseExpression(expr, COND_IF);
-        return false;
+        case CompiledSource::NODE_IF: {
+            // Try every branch until one is taken, skipping their contents
+            uint32_t branch = i;
+            while (nodes[branch].kind != CompiledSource::NODE_ENDIF &&
+                   nodes[branch].kind != CompiledSource::NODE_ELSE) {
+                if (EvaluateCondition(nodes[branch]) || failed)
+                    break;
+                branch = nodes[branch].next;
+            }
+            if (signature)
+                RecordValue(branch);
+            i = branch + 1;
+        } break;
+
+        case CompiledSource::NODE_ELIF:
+        case CompiledSource::NODE_ELSE:
+            // the end of the branch that was taken
+            i = node.endif + 1;
+            break;
+
+        case CompiledSource::NODE_ENDIF:
+            i++;
+            break;
+        }
     }
-    if (expr.compare(0, 4, "elif") == 0) {
-        expr.remove_prefix(4);
-        if (*expr.data() != ' ')
-            goto no_value;
-        ParseExpression(expr, COND_ELIF);
-        return false;
+}
+
+std::vector<std::string> SimplePreprocessor::Parse(CompiledSource const& source,
+                                                   std::vector<std::string> *dependencies) const {
+    return this->Parse(source.View(), dependencies);
+}
+
+std::vector<std::string> SimplePreprocessor::Parse(CompiledSourceView source,
+                                                   std::vector<std::string> *dependencies) const {
+    if (dependencies)
+        dependencies->clear();
+    if (source.nodes.empty() && source.text.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        return {};
     }
 
-    // TODO: ensure there are no extra tokens after the directive
-    if (expr.compare(0, 6, "output") == 0) {
-        expr.remove_prefix(6);
-        if (*expr.data() != ' ')
-            goto no_value;
-        DirectOutput(expr);
-        return false;
+    // holding the snapshot keeps it alive until the parse is done, whatever
+    // Define does in the meantime
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
+
+    std::vector<std::string> result;
+    SourceRunner runner(source, defines);
+    runner.Run(result);
+    if (runner.failed)
+        return {};
+
+    if (dependencies)
+        runner.CollectDependencies(*dependencies);
+
+    return result;
+}
+
+std::vector<std::string> SimplePreprocessor::Parse(const char *input_buffer, size_t buflen,
+                                                   std::vector<std::string> *dependencies) const {
+    if (dependencies)
+        dependencies->clear();
+    if (buflen == 0) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        return {};
     }
-    if (expr.compare(0, 4, "else") == 0) {
-        expr.remove_prefix(4);
-        ParseExpression(expr, COND_ELSE);
-        return false;
+
+    CompiledSource source;
+    if (!CompileSource({input_buffer, buflen}, source))
+        return {};
+
+    return this->Parse(source, dependencies);
+}
+
+SimplePreprocessor::SimplePreprocessor() :
+    global_defines(MakeSnapshot({}, nullptr)) {}
+
+SimplePreprocessor::SimplePreprocessor(
+    std::initializer_list<std::pair<std::string, std::variant<std::string, operand_t>>> defines) :
+    global_defines(MakeSnapshot(defines, nullptr)) {}
+
+void SimplePreprocessor::Define(DefineSet defines) {
+    if (defines.empty())
+        return;
+    global_defines.Update([&](std::shared_ptr<const DefineSnapshot> const& current) {
+        return PushLayer(current, std::move(defines));
+    });
+}
+
+SimplePreprocessor SimplePreprocessor::WithDefines(DefineSet const& defines) const {
+    std::shared_ptr<const DefineSnapshot> current = this->Snapshot();
+
+    // an overlay over an overlay gets the defines of both, over the same base
+    std::vector<const DefineSnapshot *> layers;
+    for (const DefineSnapshot *layer = current.get(); layer != nullptr; layer = layer->base.get()) {
+        layers.push_back(layer);
+        if (layer->overlay_bottom)
+            break;
     }
-    if (expr.compare(0, 5, "endif") == 0) {
-        expr.remove_prefix(4);
-        ParseExpression(expr, COND_ENDIF);
+    if (!layers.back()->overlay_bottom)
+        return SimplePreprocessor(MakeSnapshot(defines, current, true));
+
+    DefineSet merged;
+    for (size_t i = layers.size(); i-- > 0;)
+        merged.insert(merged.end(), layers[i]->defines.begin(), layers[i]->defines.end());
+    merged.insert(merged.end(), defines.begin(), defines.end());
+    return SimplePreprocessor(MakeSnapshot(std::move(merged), layers.back()->base, true));
+}
+
+std::vector<std::string> SimplePreprocessor::Parse(std::string const& input_buffer,
+                                                   std::vector<std::string> *dependencies) const {
+    return this->Parse(input_buffer.data(), input_buffer.size(), dependencies);
+}
+
+std::vector<std::string> SimplePreprocessor::ParseParallel(std::string_view input, unsigned int threads,
+                                                           std::vector<std::string> *dependencies) const {
+    if (dependencies)
+        dependencies->clear();
+    if (input.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        return {};
+    }
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    CompiledSource compiled;
+    if (!CompileSource(input, compiled, threads))
+        return {};
+
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
+
+    // Directives are cheap and have to be evaluated in order, that's done
+    // here. It leaves the list of active text nodes with every macro they
+    // use already resolved, so from now on the runner is only read.
+    std::vector<std::string> result;
+    std::vector<SourceRunner::ActiveText> plan;
+    SourceRunner runner(compiled.View(), defines);
+    runner.plan = &plan;
+    runner.Run(result);
+    if (runner.failed)
+        return {};
+    if (dependencies)
+        runner.CollectDependencies(*dependencies);
+
+    // Split the active text in ranges of about the same size, every worker
+    // replaces one into its own buffers (one per output) and they're appended
+    // in order at the end
+    size_t total = 0;
+    for (auto const& active : plan)
+        total += compiled.nodes[active.node].end - compiled.nodes[active.node].begin;
+    size_t range_count = std::min<size_t>(threads, total / PARALLEL_MIN_CHUNK);
+    range_count = std::max<size_t>(range_count, 1);
+
+    std::vector<size_t> range_begin { 0 };
+    size_t accumulated = 0;
+    for (size_t i = 0; i < plan.size() && range_begin.size() < range_count; i++) {
+        accumulated += compiled.nodes[plan[i].node].end - compiled.nodes[plan[i].node].begin;
+        if (accumulated >= total * range_begin.size() / range_count)
+            range_begin.push_back(i + 1);
+    }
+    range_begin.push_back(plan.size());
+
+    std::vector<std::vector<std::string>> parts(range_begin.size() - 1, std::vector<std::string>(result.size()));
+    auto Replace = [&](size_t r) {
+        for (size_t i = range_begin[r]; i < range_begin[r + 1]; i++) {
+            CompiledSource::Node const& node = compiled.nodes[plan[i].node];
+            std::string& out = parts[r][plan[i].output];
+            if (node.first_word == node.last_word)
+                out.append(compiled.text.data() + node.begin, node.end - node.begin);
+            else
+                runner.AppendReplaced(node, out);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t r = 1; r < parts.size(); r++)
+        workers.emplace_back(Replace, r);
+    Replace(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    for (size_t o = 0; o < result.size(); o++) {
+        size_t length = 0;
+        for (auto const& part : parts)
+            length += part[o].length();
+        result[o].reserve(length);
+        for (auto const& part : parts)
+            result[o].append(part[o]);
+    }
+    return result;
+}
+
+bool SimplePreprocessor::ParseOutputs(std::string_view input, OutputWriter const& write, unsigned int threads,
+                                      std::vector<std::string> *dependencies) const {
+    if (dependencies)
+        dependencies->clear();
+    if (input.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
         return false;
     }
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
 
+    CompiledSource compiled;
+    if (!CompileSource(input, compiled, threads))
+        return false;
 
-#if defined(PARSER_IGNORE_UNKNOWN_DIRECTIVE)
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
+
+    // The directive pass decides which text goes to which output
+    std::vector<std::string> outputs;
+    std::vector<SourceRunner::ActiveText> plan;
+    SourceRunner runner(compiled.View(), defines);
+    runner.plan = &plan;
+    runner.Run(outputs);
+    if (runner.failed)
+        return false;
+    if (dependencies)
+        runner.CollectDependencies(*dependencies);
+
+    // the active text of every output, in order
+    std::vector<std::vector<uint32_t>> output_nodes(outputs.size());
+    for (auto const& active : plan)
+        output_nodes[active.output].push_back(active.node);
+    plan = {};
+
+    // Then every output is built and written by one worker, the runner is
+    // only read from here on
+    std::atomic<size_t> next_output {0};
+    auto Work = [&]() {
+        std::string text;
+        for (size_t o = next_output.fetch_add(1, std::memory_order_relaxed); o < outputs.size();
+             o = next_output.fetch_add(1, std::memory_order_relaxed)) {
+            text.clear();
+            for (uint32_t index : output_nodes[o]) {
+                CompiledSource::Node const& node = compiled.nodes[index];
+                if (node.first_word == node.last_word)
+                    text.append(compiled.text.data() + node.begin, node.end - node.begin);
+                else
+                    runner.AppendReplaced(node, text);
+            }
+            write((unsigned int)o, text);
+        }
+    };
+
+    threads = (unsigned int)std::min<size_t>(threads, outputs.size());
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+        workers.emplace_back(Work);
+    Work();
+    for (auto& worker : workers)
+        worker.join();
     return true;
-#else
-    INTERNAL_LOG("unknown directive in %.*s", (int)expr.length(), expr.data());
-    return false;
-#endif
+}
 
-    no_value:
-    INTERNAL_FAIL("expected value in directive");
-    return false;
+// Splits an input that arrives in blocks into compiled pieces of whole lines
+struct PieceIndexer {
+    std::string carry;  // the start of a line that isn't complete yet
+    uint32_t line = 0;
+    bool empty = true;
+
+    // Returns the lines completed by block (all that's left when last), or
+    // nullptr if there are none. Sets failed if they don't compile.
+    std::unique_ptr<CompiledSource> Next(std::string_view block, bool last, bool& failed) {
+        empty = empty && block.empty();
+        carry.append(block);
+        if (last && !carry.empty() && carry.back() != '\n')
+            carry.push_back('\n'); // like CompileSource does for the last line
+        size_t end = carry.rfind('\n');
+        if (end == std::string::npos)
+            return nullptr;
+
+        auto piece = std::make_unique<CompiledSource>();
+        piece->text.assign(carry, 0, end + 1);
+        carry.erase(0, end + 1);
+
+        SourceCompiler compiler(*piece, piece->text.data());
+        compiler.chunk = true;
+        compiler.current_line = line;
+        compiler.Compile(piece->text);
+        line = compiler.current_line;
+        if (compiler.failed) {
+            failed = true;
+            return nullptr;
+        }
+        return piece;
+    }
+};
+
+// Runs the pieces of an input in order, the open conditionals and the current
+// output carry over from one to the next
+struct PieceExpander {
+    MacroScope defines;
+    std::vector<SourceRunner::OpenBranch> open;
+    unsigned int output = 0;
+
+    bool Run(CompiledSource const& piece, std::vector<OutputSegment>& produced) {
+        SourceRunner runner(piece.View(), defines);
+        runner.current_output_idx = output;
+        runner.RunPiece(open, produced);
+        output = runner.current_output_idx;
+        return !runner.failed;
+    }
+
+    // Once the last piece has run
+    bool Finish() {
+        if (!open.empty()) {
+            PARSER_LOG(PARSER_NAME": unterminated conditional directive");
+            return false;
+        }
+        return true;
+    }
+};
+
+bool SimplePreprocessor::ParseStream(StreamReader const& read, StreamSink const& sink,
+                                     size_t block_size, size_t queue_depth) const {
+    block_size = std::max<size_t>(block_size, 1);
+
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
+
+    SpscQueue<std::string> blocks(queue_depth);
+    SpscQueue<std::unique_ptr<CompiledSource>> pieces(queue_depth);
+    SpscQueue<std::vector<OutputSegment>> segments(queue_depth);
+    std::atomic<bool> failed {false};
+    auto Fail = [&]() {
+        failed.store(true, std::memory_order_relaxed);
+        blocks.Close();
+        pieces.Close();
+        segments.Close();
+    };
+
+    // read: raw blocks of the input
+    std::thread reader([&]() {
+        for (;;) {
+            std::string block(block_size, '\0');
+            std::ptrdiff_t length = read(block.data(), block.length());
+            if (length < 0) {
+                PARSER_LOG(PARSER_NAME": failed to read the input stream.");
+                Fail();
+                return;
+            }
+            if (length == 0)
+                break;
+            block.resize(length);
+            if (!blocks.Push(std::move(block)))
+                return;
+        }
+        blocks.Close();
+    });
+
+    // index: whole lines are compiled into pieces, what's left of a line
+    // waits for the next block
+    std::thread indexer([&]() {
+        PieceIndexer indexer;
+        std::string block;
+        bool more = true;
+        while (more) {
+            more = blocks.Pop(block);
+            if (failed.load(std::memory_order_relaxed))
+                return;
+            bool compile_failed = false;
+            auto piece = indexer.Next(more ? std::string_view(block) : std::string_view(), !more, compile_failed);
+            if (compile_failed) {
+                Fail();
+                return;
+            }
+            if (piece && !pieces.Push(std::move(piece)))
+                return;
+        }
+        if (indexer.empty) {
+            PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+            Fail();
+            return;
+        }
+        pieces.Close();
+    });
+
+    // expand: the conditionals and macros, piece after piece
+    std::thread expander([&]() {
+        PieceExpander expander;
+        expander.defines = defines;
+        std::unique_ptr<CompiledSource> piece;
+        while (pieces.Pop(piece)) {
+            std::vector<OutputSegment> produced;
+            if (!expander.Run(*piece, produced)) {
+                Fail();
+                return;
+            }
+            if (!produced.empty() && !segments.Push(std::move(produced)))
+                return;
+        }
+        if (failed.load(std::memory_order_relaxed))
+            return;
+        if (!expander.Finish()) {
+            Fail();
+            return;
+        }
+        segments.Close();
+    });
+
+    // emit, on the calling thread
+    std::vector<OutputSegment> produced;
+    while (segments.Pop(produced)) {
+        for (auto const& segment : produced)
+            sink(segment.output, segment.text);
+    }
+
+    reader.join();
+    indexer.join();
+    expander.join();
+    return !failed.load();
 }
 
-constexpr bool MaybePartOfWord(char c) {
-    return ('0' <= c && c <= '9') ||
-           ('a' <= c && c <= 'z') ||
-           ('A' <= c && c <= 'Z') ||
-           c == '_';
+struct IncrementalParse::State {
+    std::shared_ptr<const DefineSnapshot> snapshot;
+    PieceIndexer indexer;
+    PieceExpander expander;
+    bool failed = false;
+};
+
+IncrementalParse::IncrementalParse(std::unique_ptr<State> state) :
+    state(std::move(state)) {}
+IncrementalParse::IncrementalParse(IncrementalParse&&) noexcept = default;
+IncrementalParse& IncrementalParse::operator=(IncrementalParse&&) noexcept = default;
+IncrementalParse::~IncrementalParse() {}
+
+bool IncrementalParse::Feed(std::string_view chunk, std::vector<OutputSegment>& segments) {
+    if (state->failed)
+        return false;
+    auto piece = state->indexer.Next(chunk, false, state->failed);
+    if (piece && !state->expander.Run(*piece, segments))
+        state->failed = true;
+    return !state->failed;
 }
 
-bool ParserInternal::FindAndReplaceMacro(std::string& tmp_buf, std::string_view line_view) {
-    tmp_buf.clear();
-    bool found = false;
-
-    std::string_view current_view = line_view;
-    unsigned int word_len = 0;
-
-    while (word_len < current_view.length()) {
-        if (!MaybePartOfWord(*(current_view.data() + word_len))) {
-            if (word_len > 0) {
-                size_t before_len = current_view.data() - line_view.data();
-
-                auto kv_pair = this->defines.find({current_view.data(), word_len});
-                if (kv_pair != this->defines.end()) {
-                    found = true;
-                    // append whatever is before the macro
-                    size_t before_len = current_view.data() - line_view.data();
-                    tmp_buf.append(line_view.data(), before_len);
-                    line_view.remove_prefix(before_len + word_len);
-
-                    auto& value_var = kv_pair->second;
-                    if (std::holds_alternative<int>(value_var)) {
-                        int *pvalue = std::get_if<int>(&value_var);
-
-                        int value_len = std::snprintf(nullptr, 0, "%i", *pvalue) + 1;
-                        char *value_buf = (char *)alloca(value_len * sizeof(char));
-                        std::snprintf(value_buf, value_len, "%i", *pvalue);
-                        value_len -= 1; // - the null terminator, we don't want that int the output.
-
-                        tmp_buf.append(value_buf, value_len);
-                    } else if (std::holds_alternative<std::string_view>(value_var)) {
-                        std::string_view *pvalue = std::get_if<std::string_view>(&value_var);
-
-                        tmp_buf.append(pvalue->data(), pvalue->length());
-                    } else {
-                        PARSER_ASSERT(false); // something went very wrong if this triggers
-                    }
-                } else if (found) {
-                    tmp_buf.append(line_view.data(), before_len + word_len);
-                    line_view.remove_prefix(before_len + word_len);
-                }
+bool IncrementalParse::Finish(std::vector<OutputSegment>& segments) {
+    if (state->failed)
+        return false;
+    auto piece = state->indexer.Next({}, true, state->failed);
+    if (piece && !state->expander.Run(*piece, segments))
+        state->failed = true;
+    if (state->failed)
+        return false;
+    if (state->indexer.empty) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        state->failed = true;
+        return false;
+    }
+    state->failed = !state->expander.Finish();
+    return !state->failed;
+}
 
-                current_view.remove_prefix(word_len);
-                word_len = 0;
-            } else {
-                current_view.remove_prefix(1);
+bool IncrementalParse::Failed() const {
+    return state->failed;
+}
+
+IncrementalParse SimplePreprocessor::ParseIncremental() const {
+    auto state = std::make_unique<IncrementalParse::State>();
+    state->snapshot = this->Snapshot();
+    state->expander.defines = { nullptr, state->snapshot.get() };
+    return IncrementalParse(std::move(state));
+}
+
+std::vector<std::vector<std::string>> SimplePreprocessor::ParseMany(std::span<const std::string_view> inputs,
+                                                                    unsigned int threads) const {
+    std::vector<std::vector<std::string>> results(inputs.size());
+
+    // one table for everyone, only read from here on
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
+
+    // Inputs are handed out one at a time, so a few large ones don't leave
+    // the other workers idle
+    std::atomic<size_t> next_input {0};
+    auto Work = [&]() {
+        CompiledSource compiled; // scratch, reused for every input of this worker
+        for (size_t i = next_input.fetch_add(1, std::memory_order_relaxed); i < inputs.size();
+             i = next_input.fetch_add(1, std::memory_order_relaxed)) {
+            if (inputs[i].empty()) {
+                PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+                continue;
             }
-        } else {
-            word_len++;
+            if (!CompileSource(inputs[i], compiled))
+                continue;
+            SourceRunner runner(compiled.View(), defines);
+            runner.Run(results[i]);
+            if (runner.failed)
+                results[i].clear();
         }
+    };
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned int)std::min<size_t>(threads, inputs.size());
+
+    // the calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (unsigned int t = 1; t < threads; t++)
+        workers.emplace_back(Work);
+    Work();
+    for (auto& worker : workers)
+        worker.join();
+
+    return results;
+}
+
+std::vector<std::vector<std::string>> SimplePreprocessor::ParseVariants(std::string_view source,
+                                                                        std::span<const DefineSet> variants) const {
+    std::vector<std::vector<std::string>> results(variants.size());
+    if (source.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        return results;
     }
 
-    // append the rest of the line
-    if (found) {
-        tmp_buf.append(line_view.data(), current_view.data() - line_view.data());
+    CompiledSource compiled;
+    if (!CompileSource(source, compiled))
+        return results;
+
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    for (size_t v = 0; v < variants.size(); v++) {
+        // every variant is an overlay over the same global defines
+        MacroTable variant_defines;
+        LoadDefines(variants[v], variant_defines);
+        MacroScope defines { &variant_defines, snapshot.get() };
+
+        SourceRunner runner(compiled.View(), defines);
+        runner.Run(results[v]);
+        if (runner.failed)
+            results[v].clear();
     }
 
-    return found;
+    return results;
 }
 
-std::vector<std::string> SimplePreprocessor::Parse(const char *input_buffer, size_t buflen) {
-    if (buflen == 0) {
+std::vector<std::string> SimplePreprocessor::VariantOutputs::Materialize(size_t variant) const {
+    Variant const& v = this->variants[variant];
+    std::vector<std::string> result(v.stream_count);
+
+    uint32_t e = v.edit_begin;
+    for (uint32_t stream = 0; stream < v.stream_count; stream++) {
+        static const std::vector<Piece> empty;
+        std::vector<Piece> const& pieces = stream < this->base.size() ? this->base[stream] : empty;
+        auto append = [&](Piece const& piece) {
+            result[stream].append(this->text, piece.offset, piece.length);
+        };
+
+        uint32_t position = 0;
+        for (; e < v.edit_end && this->edits[e].stream == stream; e++) {
+            Edit const& edit = this->edits[e];
+            for (; position < edit.position; position++)
+                append(pieces[position]);
+            for (uint32_t i = 0; i < edit.insert_count; i++)
+                append(this->inserted[edit.insert_begin + i]);
+            position += edit.erase;
+        }
+        for (; position < pieces.size(); position++)
+            append(pieces[position]);
+    }
+
+    return result;
+}
+
+size_t SimplePreprocessor::VariantOutputs::MemoryUsage() const {
+    size_t bytes = this->text.capacity() +
+                   this->inserted.capacity() * sizeof(Piece) +
+                   this->edits.capacity() * sizeof(Edit) +
+                   this->variants.capacity() * sizeof(Variant);
+    for (auto const& stream : this->base)
+        bytes += stream.capacity() * sizeof(Piece);
+    return bytes;
+}
+
+SimplePreprocessor::VariantOutputs SimplePreprocessor::ParseVariantsDelta(std::string_view source,
+                                                                          std::span<const DefineSet> variants) const {
+    using Piece = VariantOutputs::Piece;
+    using Edit = VariantOutputs::Edit;
+
+    VariantOutputs outputs;
+    outputs.variants.resize(variants.size());
+    if (source.empty()) {
         PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
-        return {};
+        return outputs;
     }
 
-    ParserInternal internal;
-    
-    // I don't like this
-    for (auto &def : this->global_defines) {
-        auto& value_variant = def.second;
-        if (std::holds_alternative<int>(value_variant)) {
-            int *pvalue = std::get_if<int>(&value_variant);
-            internal.defines[def.first] = *pvalue;
+    CompiledSource compiled;
+    if (!CompileSource(source, compiled))
+        return outputs;
+    outputs.text = compiled.text;
+
+    // replaced text is stored once, whichever variant and node produced it
+    std::unordered_map<std::string, uint32_t> stored;
+    std::vector<std::vector<Piece>> pieces;
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    for (size_t v = 0; v < variants.size(); v++) {
+        // every variant is an overlay over the same global defines
+        MacroTable variant_defines;
+        LoadDefines(variants[v], variant_defines);
+        MacroScope defines { &variant_defines, snapshot.get() };
+
+        pieces.clear();
+        std::vector<std::string> streams;
+        SourceRunner runner(compiled.View(), defines);
+        runner.pieces = &pieces;
+        runner.Run(streams);
+
+        VariantOutputs::Variant& variant = outputs.variants[v];
+        variant.edit_begin = variant.edit_end = outputs.edits.size();
+        if (runner.failed) {
+            variant.stream_count = 0;
             continue;
         }
-        if (std::holds_alternative<std::string>(value_variant)) {
-            std::string *pvalue = std::get_if<std::string>(&value_variant);
-            internal.defines[def.first] = *pvalue;
+        variant.stream_count = streams.size();
+
+        for (auto& stream : pieces) {
+            for (Piece& piece : stream) {
+                CompiledSource::Node const& node = compiled.nodes[piece.node];
+                if (node.first_word == node.last_word)
+                    continue;
+                std::string replaced = runner.piece_text.substr(piece.offset, piece.length);
+                auto [it, inserted] = stored.try_emplace(std::move(replaced), outputs.text.length());
+                if (inserted)
+                    outputs.text.append(it->first);
+                piece.offset = it->second;
+            }
+        }
+
+        if (v == 0) {
+            outputs.base = pieces;
             continue;
         }
-        PARSER_ASSERT(false);
+
+        // Both sides are in node order and a node appears at most once per
+        // stream, so a merge walk finds the differences
+        for (uint32_t stream = 0; stream < variant.stream_count; stream++) {
+            static const std::vector<Piece> empty;
+            std::vector<Piece> const& from = stream < outputs.base.size() ? outputs.base[stream] : empty;
+            std::vector<Piece> const& to = stream < pieces.size() ? pieces[stream] : empty;
+
+            Edit *edit = nullptr;
+            size_t i = 0, j = 0;
+            while (i < from.size() || j < to.size()) {
+                bool erase = false, insert = false;
+                if (i == from.size())
+                    insert = true;
+                else if (j == to.size())
+                    erase = true;
+                else if (from[i].node < to[j].node)
+                    erase = true;
+                else if (to[j].node < from[i].node)
+                    insert = true;
+                else if (from[i].offset != to[j].offset || from[i].length != to[j].length)
+                    erase = insert = true;
+
+                if (!erase && !insert) {
+                    edit = nullptr;
+                    i++, j++;
+                    continue;
+                }
+                if (edit == nullptr) {
+                    outputs.edits.push_back({ stream, (uint32_t)i, 0, (uint32_t)outputs.inserted.size(), 0 });
+                    edit = &outputs.edits.back();
+                }
+                if (erase) {
+                    edit->erase++;
+                    i++;
+                }
+                if (insert) {
+                    outputs.inserted.push_back(to[j]);
+                    edit->insert_count++;
+                    j++;
+                }
+            }
+        }
+        variant.edit_end = outputs.edits.size();
     }
 
-    std::vector<std::string> result;
+    outputs.text.shrink_to_fit();
+    outputs.inserted.shrink_to_fit();
+    outputs.edits.shrink_to_fit();
+    return outputs;
+}
 
-    // used only when we find something during the macro processing pass
-    std::string tmp_buf;
-    std::string_view input_view(input_buffer, buflen);
+void SimplePreprocessor::AppendDefineValues(std::span<const std::string> names, std::string& key) const {
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
 
-    
-    while (!input_view.empty()) {
-        if (internal.failed)
-            return {};
+    for (auto const& name : names) {
+        key.append(name);
+        const MacroValue *macro = snapshot->Find(name);
+        if (macro == nullptr) {
+            key.push_back('\0');
+            continue;
+        }
+        // the type tag keeps "1" and 1 apart, the length keeps values apart
+        // from the names that follow them
+        if (const operand_t *pvalue = std::get_if<operand_t>(macro)) {
+            key.push_back('\1');
+            key.append((const char *)pvalue, sizeof(*pvalue));
+        } else {
+            std::string_view value = std::get<std::string_view>(*macro);
+            uint64_t length = value.length();
+            key.push_back('\2');
+            key.append((const char *)&length, sizeof(length));
+            key.append(value);
+        }
+    }
+}
 
-        internal.current_line += 1;
+SimplePreprocessor::UniqueVariants SimplePreprocessor::ParseUniqueVariants(std::string_view source,
+                                                                       std::span<const DefineSet> variants) const {
+    UniqueVariants unique;
+    unique.variant_output.resize(variants.size());
+    if (source.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        unique.outputs.emplace_back();
+        return unique;
+    }
 
-        size_t next_pos = input_view.find('\n');
-        std::string_view row_final(input_view.data(), next_pos);
-
-        // Macro preprocessor pass
-        bool found = internal.FindAndReplaceMacro(tmp_buf, {input_view.data(), next_pos + 1});
-        if (found) {
-            row_final = {tmp_buf.data(), tmp_buf.length() - 1};
-        }
-
-        // Parse thee directive (we sometimes want to append it to the output)
-        bool append = true;
-        if (*row_final.data() == _PFX) {
-            append = internal.ParseDirective(row_final);
-        }
-
-        // NOTE: This is dirty. If (hypothetically) the indices we're getting from
-        // the file are 0 and 14, we're going to have 15 strings, out of which 13
-        // are unused.
-        // TODO: Allow the user to specify the amount of outputs expected and handle
-        // cases where the file declares more than that
-        if (internal.current_output_idx >= result.size())
-            result.resize(internal.current_output_idx + 1);
-        std::string& output = result[internal.current_output_idx];
-
-        if (append) {
-            if (internal.condition.empty() ||
-                internal.condition.top().result == true) {
-                output.append(row_final.data(), row_final.length());
-                output.append("\n");
-            }
+    CompiledSource compiled;
+    if (!CompileSource(source, compiled)) {
+        unique.outputs.emplace_back();
+        return unique;
+    }
+
+    std::unordered_map<std::string, size_t> seen;
+    std::string signature;
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    for (size_t v = 0; v < variants.size(); v++) {
+        // every variant is an overlay over the same global defines
+        MacroTable variant_defines;
+        LoadDefines(variants[v], variant_defines);
+        MacroScope defines { &variant_defines, snapshot.get() };
+
+        SourceRunner runner(compiled.View(), defines);
+        runner.RunSignature(signature);
+        if (runner.failed)
+            signature = "\xFF"; // never a valid signature, failures share an empty output
+
+        auto [it, inserted] = seen.try_emplace(signature, unique.outputs.size());
+        unique.variant_output[v] = it->second;
+        if (!inserted)
+            continue;
+
+        // first time we see this signature, build the output for real
+        unique.outputs.emplace_back();
+        if (!runner.failed) {
+            SourceRunner output_runner(compiled.View(), defines);
+            output_runner.Run(unique.outputs.back());
         }
+    }
 
-        if (next_pos == std::string::npos)
-            break;
+    return unique;
+}
 
-        input_view.remove_prefix(next_pos + 1);
+std::vector<SimplePreprocessor::ReachableOutput> SimplePreprocessor::EnumerateVariants(
+        std::string_view source, std::span<const MacroDomain> domains) const {
+    std::vector<std::vector<operand_t>> all_values;
+    for (auto const& domain : domains)
+        all_values.push_back(domain.values);
+
+    // a source that doesn't compile fails under every assignment
+    std::vector<ReachableOutput> reachable;
+    if (source.empty()) {
+        PARSER_LOG(PARSER_NAME": you passed a empty buffer.");
+        reachable.push_back({ {}, { std::move(all_values) } });
+        return reachable;
     }
 
-    if(!internal.condition.empty()) {
-        PARSER_LOG(PARSER_NAME": unterminated conditional directive");
-        return {};
+    CompiledSource compiled;
+    if (!CompileSource(source, compiled)) {
+        reachable.push_back({ {}, { std::move(all_values) } });
+        return reachable;
     }
 
-    return result;
-}
+    std::shared_ptr<const DefineSnapshot> snapshot = this->Snapshot();
+    MacroScope defines { nullptr, snapshot.get() };
 
-std::vector<std::string> SimplePreprocessor::Parse(std::string const& input_buffer) {
-    return this->Parse(input_buffer.data(), input_buffer.size());
-}
+    CompiledSourceView view = compiled.View();
+    std::vector<int> symbol_domain(view.SymbolCount(), -1);
+    for (size_t d = 0; d < domains.size(); d++) {
+        for (uint32_t symbol = 0; symbol < view.SymbolCount(); symbol++) {
+            if (view.Symbol(symbol) == domains[d].name)
+                symbol_domain[symbol] = (int)d;
+        }
+    }
+
+    // Depth first over the subsets of the domains. A run either finishes, and
+    // its subsets are one of the assignments of its output, or stops at the
+    // first undecided macro it consults and gets split.
+    std::vector<std::vector<std::vector<operand_t>>> pending;
+    pending.push_back(std::move(all_values));
+
+    std::map<std::vector<std::string>, size_t> seen;
+    while (!pending.empty()) {
+        std::vector<std::vector<operand_t>> subsets = std::move(pending.back());
+        pending.pop_back();
+
+        std::vector<std::string> output;
+        SourceRunner runner(compiled.View(), defines);
+        runner.symbol_domain = &symbol_domain;
+        runner.subsets = &subsets;
+        runner.Run(output);
+
+        if (runner.split_domain >= 0) {
+            for (auto& part : runner.split_parts) {
+                pending.push_back(subsets);
+                pending.back()[runner.split_domain] = std::move(part);
+            }
+            continue;
+        }
+        if (runner.failed)
+            output.clear();
 
+        auto [it, inserted] = seen.try_emplace(output, reachable.size());
+        if (inserted)
+            reachable.push_back({ std::move(output), {} });
+        reachable[it->second].assignments.push_back(std::move(subsets));
+    }
+
+    return reachable;
+}
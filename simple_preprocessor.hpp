@@ -5,8 +5,10 @@
  *  evaluation.
  *
  *  Features:
- *  - String to string or string to int macros
+ *  - String to string or string to integer macros (operand_t, see
+ *    arithmetic_parser.hpp for how to make it 64 bit)
  *  - Simple if, elif, else, endif conditional directives. Can be nested.
+ *    Expressions are only evaluated when their branch can be taken.
  *  - Arithmetic parser for conditionals. Evaluated after macro replacement.
  *  - Will output a vector of strings. by default, everything gets appended into
  *    the first string (index 0). the #output directive along with a number can
@@ -40,30 +42,345 @@
 
 #define PARSER_IGNORE_UNKNOWN_DIRECTIVE
 
+// Bumped whenever the output for the same input and defines could change.
+// Persistent caches use it to drop results from older versions.
+#define SIMPLE_PREPROCESSOR_VERSION 2
+
+#include "arithmetic_parser.hpp"
+#include "snapshot_cell.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <initializer_list>
+#include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 
 
+/******************************************************************************
+ *  Compiled sources
+ *
+ *  CompileSource records the directive structure of a source once, so it can
+ *  be run against any number of define sets without looking at the text
+ *  again. Consecutive text lines become a single node, and conditionals know
+ *  their next branch and their #endif, so running a define set only evaluates
+ *  the directives of the branches it actually reaches and copies whole active
+ *  text nodes, replacing the macro words recorded in them. Inactive text is
+ *  never touched and text without words is never rescanned.
+ *
+ *  Directives are recognized on the source text. A line that only turns into
+ *  a directive after macro replacement is treated as text, and #output only
+ *  takes effect in active branches.
+ *  Macro names have to start with a letter or an underscore.
+ *  The offsets into the text are 32 bit: sources of 4 GiB or more don't
+ *  compile, and fail to parse.
+ ******************************************************************************/
+
+struct CompiledSource {
+    enum NodeKind : unsigned char {
+        NODE_TEXT = 0,
+        NODE_IF,
+        NODE_ELIF,
+        NODE_ELSE,
+        NODE_ENDIF,
+        NODE_OUTPUT,
+    };
+
+    struct Node {
+        NodeKind kind;
+        uint32_t line;          // first line of the node, for error messages
+        uint32_t begin, end;    // text: the lines (newlines included), directives: their argument
+        uint32_t first_word, last_word; // words inside [begin, end)
+        uint32_t code_begin, code_end;  // if/elif: compiled expression, empty if it didn't compile
+        uint32_t next;          // if/elif/else: next branch of the same conditional
+        uint32_t endif;         // if/elif/else: the matching endif
+    };
+
+    struct Word {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t symbol;
+    };
+
+    std::string text;                   // always ends with a newline
+    std::vector<Node> nodes;
+    std::vector<Word> words;
+    // the unique words, back to back: symbol i is
+    // symbol_names[symbol_offsets[i], symbol_offsets[i + 1]). Words and the
+    // symbols of the code refer to these.
+    std::string symbol_names;
+    std::vector<uint32_t> symbol_offsets {0};
+    std::vector<ExpressionInstruction> code;
+
+    struct CompiledSourceView View() const;
+};
+
+// A compiled source that doesn't own its data, either a CompiledSource or one
+// loaded from its binary form (see precompiled_source.hpp). It's all the
+// runner needs.
+struct CompiledSourceView {
+    std::string_view text;
+    std::span<const CompiledSource::Node> nodes;
+    std::span<const CompiledSource::Word> words;
+    std::string_view symbol_names;
+    std::span<const uint32_t> symbol_offsets;
+    std::span<const ExpressionInstruction> code;
+
+    size_t SymbolCount() const { return symbol_offsets.size() - 1; }
+    std::string_view Symbol(uint32_t symbol) const {
+        return symbol_names.substr(symbol_offsets[symbol], symbol_offsets[symbol + 1] - symbol_offsets[symbol]);
+    }
+};
+
+inline CompiledSourceView CompiledSource::View() const {
+    return { text, nodes, words, symbol_names, symbol_offsets, code };
+}
+
+// Text offsets are 32 bit, so sources are limited to this many bytes
+inline constexpr size_t COMPILED_SOURCE_MAX_LENGTH = UINT32_MAX - 1;
+
+// Returns false (and logs why) if the directives are malformed, or if the
+// source is longer than COMPILED_SOURCE_MAX_LENGTH
+bool CompileSource(std::string_view source, CompiledSource& out);
+// Same result, but large sources are compiled in line aligned chunks on up to
+// threads threads (0 for one per hardware thread) and stitched together. The
+// size limit is the same.
+bool CompileSource(std::string_view source, CompiledSource& out, unsigned int threads);
+
+
+// The defines of a preprocessor, ready for lookups (see Define)
+struct DefineSnapshot;
+
+// A part of an output, in the order it was produced
+struct OutputSegment {
+    unsigned int output;
+    std::string text;
+};
+
+// An input parsed as it arrives, on the calling thread (see
+// SimplePreprocessor::ParseIncremental). Feed appends the output of every line
+// the chunk completes to segments, Finish the output of the rest once the
+// input is over. Both return false once the input turns out not to parse,
+// what was produced before the error stays produced.
+class IncrementalParse {
+public:
+    IncrementalParse(IncrementalParse&&) noexcept;
+    IncrementalParse& operator=(IncrementalParse&&) noexcept;
+    ~IncrementalParse();
+
+    bool Feed(std::string_view chunk, std::vector<OutputSegment>& segments);
+    bool Finish(std::vector<OutputSegment>& segments);
+    bool Failed() const;
+
+private:
+    friend class SimplePreprocessor;
+    struct State;
+
+    explicit IncrementalParse(std::unique_ptr<State> state);
+
+    std::unique_ptr<State> state;
+};
+
 class SimplePreprocessor {
 public:
-    SimplePreprocessor() {}
-    SimplePreprocessor(std::initializer_list<std::pair<std::string, std::variant<std::string, int>>> defines) :
-        global_defines(defines) {}
+    using DefineSet = std::vector<std::pair<std::string, std::variant<std::string, operand_t>>>;
+
+    SimplePreprocessor();
+    SimplePreprocessor(std::initializer_list<std::pair<std::string, std::variant<std::string, operand_t>>> defines);
+    // A copy shares the defines of the moment with the original, later
+    // Defines on either don't reach the other. Copying is cheap, it's how to
+    // run several calls against exactly the same defines.
+    SimplePreprocessor(SimplePreprocessor const& other) :
+        global_defines(other.Snapshot()) {}
+    SimplePreprocessor& operator=(SimplePreprocessor const& other) {
+        global_defines.Store(other.Snapshot());
+        return *this;
+    }
     ~SimplePreprocessor() {}
 
+    // The defines are an immutable snapshot: Define builds a new one and swaps
+    // it in, the old one goes away once the last parse holding it is done.
+    // Every parse takes the snapshot once when it starts and uses it to the
+    // end, so Define can be called while other threads parse. Taking it never
+    // blocks, Defines from several threads are applied one after the other.
+    // A Define costs O(log n) amortized copies of every macro for n defines,
+    // a batch of them publishes a single snapshot.
     void Define(std::string key, std::string value) {
-        global_defines.push_back({key, value});
+        this->Define(DefineSet { { std::move(key), std::move(value) } });
     }
-    void Define(std::string key, int value = 1) {
-        global_defines.push_back({key, value});
+    void Define(std::string key, operand_t value = 1) {
+        this->Define(DefineSet { { std::move(key), value } });
     }
+    void Define(DefineSet defines);
+
+    // Returns a preprocessor with defines on top of the current ones of this
+    // one, which it shares instead of copying: creating it only costs as much
+    // as the overlay, and macros are looked up in the overlay first and then
+    // in the shared set. Meant for a few defines per request over a large
+    // common set. Later Defines on this preprocessor don't reach the overlay,
+    // Defines on the overlay only touch the overlay.
+    SimplePreprocessor WithDefines(DefineSet const& defines) const;
+
+    // Parse and the other const methods keep their state on the stack, so they
+    // can run from several threads at once, Define included.
+    //
+    // If dependencies is given, it receives the (sorted) names of every macro
+    // that was looked up while parsing: the words of the active text and of
+    // the evaluated directives, whether they were defined or not. Any define
+    // set that agrees on those macros produces the same output.
+    std::vector<std::string> Parse(std::string const& input_buffer,
+                                   std::vector<std::string> *dependencies = nullptr) const;
+    std::vector<std::string> Parse(const char *input_buffer, size_t buflen,
+                                   std::vector<std::string> *dependencies = nullptr) const;
+    std::vector<std::string> Parse(CompiledSource const& source,
+                                   std::vector<std::string> *dependencies = nullptr) const;
+    std::vector<std::string> Parse(CompiledSourceView source,
+                                   std::vector<std::string> *dependencies = nullptr) const;
+
+    // Same output as Parse, for very large inputs: the source is compiled in
+    // chunks in parallel, the directives are evaluated in order, then the
+    // macros of the active text are replaced in parallel again. Inputs under
+    // a few MiB are parsed sequentially. Like Parse, it takes inputs of up to
+    // COMPILED_SOURCE_MAX_LENGTH bytes (just under 4 GiB) and fails on larger
+    // ones.
+    std::vector<std::string> ParseParallel(std::string_view input, unsigned int threads = 0,
+                                           std::vector<std::string> *dependencies = nullptr) const;
+
+    // Same as Parse, but the outputs are handed to write instead of being
+    // returned, and they're built and written concurrently: once the
+    // directives have decided which text goes to which output, every output
+    // is replaced and written by one of up to threads workers (0 for one per
+    // hardware thread, the calling thread included). write gets called once
+    // for every output index, empty ones included, from any of the workers,
+    // but never twice at the same time for the same output.
+    // Returns false (writing nothing) if the input fails to parse.
+    using OutputWriter = std::function<void(unsigned int output, std::string_view text)>;
+    bool ParseOutputs(std::string_view input, OutputWriter const& write, unsigned int threads = 0,
+                      std::vector<std::string> *dependencies = nullptr) const;
 
-    std::vector<std::string> Parse(std::string const& input_buffer);
-    std::vector<std::string> Parse(const char *input_buffer, size_t buflen);
+    // Parses an input that arrives bit by bit, with the work spread over a
+    // pipeline of threads: one reads blocks of block_size bytes, one compiles
+    // their whole lines, one runs the conditionals and replaces the macros,
+    // and the calling thread hands the text to sink as it comes out. The
+    // stages are connected by bounded queues of queue_depth entries, so the
+    // memory used doesn't depend on the size of the input.
+    // read fills the buffer and returns how much it wrote, 0 at the end of
+    // the input and a negative value on errors. The output is the same as
+    // Parse would give for the whole input, but errors can only be found once
+    // they're reached: everything before them has been given to sink already,
+    // and false is returned.
+    using StreamReader = std::function<std::ptrdiff_t(char *buffer, size_t capacity)>;
+    using StreamSink = std::function<void(unsigned int output, std::string_view text)>;
+    bool ParseStream(StreamReader const& read, StreamSink const& sink,
+                     size_t block_size = 1 << 20, size_t queue_depth = 4) const;
+
+    // Same output as ParseStream, but the caller pushes the input in and gets
+    // the output back, without any threads. Uses the defines of the moment
+    // it's called. See async_parse.hpp for coroutines over it.
+    IncrementalParse ParseIncremental() const;
+
+    // Parses every input on its own, spread over threads workers (0 uses one
+    // per hardware thread, the calling thread included). The workers share
+    // the define table and keep their own scratch buffers. results[i] is the
+    // output of inputs[i], an input that fails gets an empty output.
+    // Every input is parsed with the defines of the moment it's called, a
+    // Define while it runs only affects later calls.
+    std::vector<std::vector<std::string>> ParseMany(std::span<const std::string_view> inputs,
+                                                    unsigned int threads = 0) const;
+
+    // Parses the same source once for every define set (applied on top of the
+    // global defines). The source is only compiled once, and each variant
+    // only evaluates its directives and copies its active text. A variant that
+    // fails gets an empty output.
+    std::vector<std::vector<std::string>> ParseVariants(std::string_view source,
+                                                        std::span<const DefineSet> variants) const;
+
+    // Same as ParseVariants, but variants that produce the same output share
+    // it. While running a variant, a compact signature of its branch
+    // decisions and replaced macro values is computed first, and the output
+    // is only built for signatures that weren't seen yet.
+    // outputs[variant_output[i]] is the output of variants[i].
+    struct UniqueVariants {
+        std::vector<std::vector<std::string>> outputs;
+        std::vector<size_t> variant_output;
+    };
+    UniqueVariants ParseUniqueVariants(std::string_view source, std::span<const DefineSet> variants) const;
+
+    // Same as ParseVariants, but the outputs are stored as the output of the
+    // first variant plus, for every other variant, the places where its
+    // output differs from it. The outputs are made of pieces, one for every
+    // active text node, and pieces are either text of the source or replaced
+    // text stored once for all the variants that produce it, so variants that
+    // only differ in a few conditional regions only cost a few edits.
+    // Materialize builds the full output of a variant when it's needed.
+    struct VariantOutputs {
+        struct Piece {
+            uint32_t node;              // text node of the source
+            uint32_t offset, length;    // in text
+        };
+        // Replaces erase pieces of the base stream, starting at position,
+        // with inserted[insert_begin, insert_begin + insert_count)
+        struct Edit {
+            uint32_t stream;
+            uint32_t position;
+            uint32_t erase;
+            uint32_t insert_begin, insert_count;
+        };
+        struct Variant {
+            uint32_t edit_begin, edit_end;
+            uint32_t stream_count;      // 0 if the variant failed
+        };
+
+        std::string text;               // the source text, then every distinct replaced text
+        std::vector<std::vector<Piece>> base;
+        std::vector<Piece> inserted;
+        std::vector<Edit> edits;        // sorted by stream then position within a variant
+        std::vector<Variant> variants;
+
+        size_t size() const { return variants.size(); }
+        bool Failed(size_t variant) const { return variants[variant].stream_count == 0; }
+        // A failed variant gets an empty output, like in ParseVariants
+        std::vector<std::string> Materialize(size_t variant) const;
+        size_t MemoryUsage() const;
+    };
+    VariantOutputs ParseVariantsDelta(std::string_view source, std::span<const DefineSet> variants) const;
+
+    // Finds every distinct output the source can produce when each of the
+    // domain macros takes one of its values (on top of the global defines),
+    // without going through every combination: the conditional structure is
+    // walked and only the macros that actually get consulted are branched on,
+    // with values that lead to the same decision kept together.
+    // Each output comes with the subsets of the domains that produce it, in
+    // the order of domains (a macro that was never consulted keeps all its
+    // values). Assignments that fail to parse share an empty output, so a
+    // source that doesn't compile gives that one output for all of them.
+    struct MacroDomain {
+        std::string name;
+        std::vector<operand_t> values;
+    };
+    struct ReachableOutput {
+        std::vector<std::string> output;
+        std::vector<std::vector<std::vector<operand_t>>> assignments;
+    };
+    std::vector<ReachableOutput> EnumerateVariants(std::string_view source,
+                                                   std::span<const MacroDomain> domains) const;
+
+    // Appends the current values of the given macros to key, in a form that
+    // only compares equal for equal values (undefined macros included).
+    void AppendDefineValues(std::span<const std::string> names, std::string& key) const;
 
 private:
-    std::vector<std::pair<std::string, std::variant<std::string, int>>> global_defines;
+    explicit SimplePreprocessor(std::shared_ptr<const DefineSnapshot> snapshot) :
+        global_defines(std::move(snapshot)) {}
+
+    std::shared_ptr<const DefineSnapshot> Snapshot() const {
+        return global_defines.Load();
+    }
+
+    SnapshotCell<DefineSnapshot> global_defines;
 };
 
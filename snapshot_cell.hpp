@@ -0,0 +1,96 @@
+/******************************************************************************
+ *  Read-mostly snapshot cell
+ *
+ *  Holds a shared_ptr to an immutable value that many threads read and a few
+ *  replace now and then. Load never blocks: it copies the current pointer out
+ *  of one of two slots, counting itself in that slot while it does. Store
+ *  fills the slot that isn't current once its last reader has left, then
+ *  makes it current, so a reader only retries if a store flipped the slots
+ *  under it. Stores are serialized by a mutex and wait for readers of the old
+ *  slot, which only ever copy a pointer.
+ *
+ *  An old value lives until the store after next overwrites its slot and every
+ *  reader that loaded it has dropped its copy, so a reader can keep using what
+ *  it loaded for as long as it likes.
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+template <typename T>
+class SnapshotCell {
+public:
+    explicit SnapshotCell(std::shared_ptr<const T> value) {
+        slots[0].value = std::move(value);
+    }
+    SnapshotCell(SnapshotCell const&) = delete;
+    SnapshotCell& operator=(SnapshotCell const&) = delete;
+
+    std::shared_ptr<const T> Load() const {
+        for (;;) {
+            unsigned int index = current.load(std::memory_order_seq_cst);
+            Slot const& slot = slots[index];
+            slot.readers.fetch_add(1, std::memory_order_seq_cst);
+            // the store may have flipped (and be about to refill) the slot
+            // between the two loads, only a slot that is still current is safe
+            if (current.load(std::memory_order_seq_cst) != index) {
+                slot.readers.fetch_sub(1, std::memory_order_release);
+                continue;
+            }
+            std::shared_ptr<const T> value = slot.value;
+            slot.readers.fetch_sub(1, std::memory_order_release);
+            return value;
+        }
+    }
+
+    void Store(std::shared_ptr<const T> value) {
+        std::lock_guard lock(store_mutex);
+        this->StoreLocked(std::move(value));
+    }
+
+    // Stores update(current value) as one step, no other Store or Update gets
+    // in between
+    template <typename Function>
+    void Update(Function&& update) {
+        std::lock_guard lock(store_mutex);
+        this->StoreLocked(update(slots[current.load(std::memory_order_relaxed)].value));
+    }
+
+private:
+    struct Slot {
+        std::shared_ptr<const T> value;
+        mutable std::atomic<unsigned int> readers {0};
+    };
+
+    void StoreLocked(std::shared_ptr<const T> value) {
+        unsigned int next = current.load(std::memory_order_relaxed) ^ 1;
+        Slot& slot = slots[next];
+        // readers that got in before the last flip are only copying a pointer
+        while (slot.readers.load(std::memory_order_seq_cst) != 0)
+            std::this_thread::yield();
+        slot.value = std::move(value);
+        current.store(next, std::memory_order_seq_cst);
+    }
+
+    Slot slots[2];
+    std::atomic<unsigned int> current {0};
+    std::mutex store_mutex;
+};
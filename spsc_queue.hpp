@@ -0,0 +1,96 @@
+/******************************************************************************
+ *  Bounded single producer, single consumer queue
+ *
+ *  A ring buffer with one thread pushing and another popping, the only shared
+ *  state is the two indices. Push waits while the ring is full and Pop while
+ *  it's empty (spinning a little, then yielding, then sleeping), which is what
+ *  keeps the memory of a pipeline bounded.
+ *
+ *  Close ends the queue: the consumer still gets what was pushed before, then
+ *  Pop returns false. Either side can close it, so a consumer that gives up
+ *  makes the next Push return false and the producer stops too.
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class SpscQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    bool Push(T item) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        for (unsigned int waited = 0; position - head.load(std::memory_order_acquire) > mask; waited++) {
+            if (closed.load(std::memory_order_acquire))
+                return false;
+            Wait(waited);
+        }
+        if (closed.load(std::memory_order_acquire))
+            return false;
+        slots[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& item) {
+        size_t position = head.load(std::memory_order_relaxed);
+        for (unsigned int waited = 0; position == tail.load(std::memory_order_acquire); waited++) {
+            // the tail is checked again after seeing closed, the last push may
+            // have landed in between
+            if (closed.load(std::memory_order_acquire) && position == tail.load(std::memory_order_acquire))
+                return false;
+            Wait(waited);
+        }
+        item = std::move(slots[position & mask]);
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    void Close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+private:
+    static void Wait(unsigned int waited) {
+        // just spin for a few rounds, the other side is usually right behind
+        if (waited < 64)
+            return;
+        if (waited < 256)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head {0}; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail {0}; // next slot to push, written by the producer
+    std::atomic<bool> closed {false};
+};
@@ -0,0 +1,116 @@
+/******************************************************************************
+ *  Checks the coroutine parse: both generators give the output of Parse, and
+ *  a session destroyed while its parse waits for input (a client that went
+ *  away mid stream) leaves nothing behind for the channel to resume. Best run
+ *  with -fsanitize=address.
+ *
+ *  g++ -std=c++20 -I.. async_parse_test.cpp ../async_parse.cpp \
+ *      ../simple_preprocessor.cpp ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "async_parse.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// The coroutine of a session: owns its parse and collects what it yields
+struct Session {
+    struct promise_type {
+        Session get_return_object() {
+            return Session { std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    Session(Session&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    explicit Session(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    ~Session() {
+        if (handle)
+            handle.destroy();
+    }
+};
+
+static Session Consume(SimplePreprocessor const& preprocessor, ChunkChannel& input,
+                       std::vector<std::string>& outputs, bool& failed) {
+    AsyncSegmentGenerator parse = ParseSegmentsAsync(preprocessor, input);
+    while (std::optional<OutputSegment> segment = co_await parse.Next()) {
+        if (outputs.size() <= segment->output)
+            outputs.resize(segment->output + 1);
+        outputs[segment->output] += segment->text;
+    }
+    failed = parse.Failed();
+}
+
+static const char *SOURCE =
+    "first A\n"
+    "#if A > 1\n"
+    "big\n"
+    "#else\n"
+    "#output 1\n"
+    "small B\n"
+    "#endif\n"
+    "#output 0\n"
+    "last\n";
+
+int main() {
+    SimplePreprocessor preprocessor { { "A", 1 }, { "B", "bee" } };
+    std::string source = SOURCE;
+    std::vector<std::string> expected = preprocessor.Parse(source);
+    int failures = 0;
+
+    for (size_t chunk = 1; chunk <= source.length(); chunk++) {
+        std::vector<std::string> outputs;
+        SegmentGenerator parse = ParseSegments(preprocessor, source, chunk);
+        while (parse.Next()) {
+            OutputSegment& segment = parse.Current();
+            if (outputs.size() <= segment.output)
+                outputs.resize(segment.output + 1);
+            outputs[segment.output] += segment.text;
+        }
+        outputs.resize(expected.size());
+        if (parse.Failed() || outputs != expected) {
+            std::printf("FAIL: ParseSegments with %zu byte chunks\n", chunk);
+            failures++;
+        }
+
+        ChunkChannel input;
+        bool failed = false;
+        outputs.clear();
+        Session session = Consume(preprocessor, input, outputs, failed);
+        for (size_t i = 0; i < source.length(); i += chunk)
+            input.Push(source.substr(i, chunk));
+        input.Close();
+        outputs.resize(expected.size());
+        if (!session.handle.done() || failed || outputs != expected) {
+            std::printf("FAIL: ParseSegmentsAsync with %zu byte chunks\n", chunk);
+            failures++;
+        }
+    }
+
+    // A session dropped while its parse waits in the middle of the input
+    {
+        ChunkChannel input;
+        bool failed = false;
+        std::vector<std::string> outputs;
+        {
+            Session session = Consume(preprocessor, input, outputs, failed);
+            input.Push(source.substr(0, 12));
+        }
+        input.Push(source.substr(12));
+        input.Close();
+        if (outputs.empty() || outputs[0] != "first 1\n") {
+            std::printf("FAIL: a dropped session\n");
+            failures++;
+        }
+    }
+
+    if (failures == 0)
+        std::printf("async_parse_test: ok\n");
+    return failures == 0 ? 0 : 1;
+}
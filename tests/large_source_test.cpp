@@ -0,0 +1,67 @@
+/******************************************************************************
+ *  Checks that sources too large for the 32 bit offsets of a compiled source
+ *  fail cleanly on every path instead of being cut down: the sequential and
+ *  the chunked compile, Parse and ParseParallel. The input is a mapping of
+ *  zero pages just over the limit, so the test needs neither the memory nor
+ *  the time to build a real one.
+ *
+ *  g++ -std=c++20 -pthread -I.. large_source_test.cpp \
+ *      ../simple_preprocessor.cpp ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "simple_preprocessor.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/mman.h>
+
+int main() {
+    int failures = 0;
+
+    size_t length = COMPILED_SOURCE_MAX_LENGTH + 1;
+    void *memory = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::printf("large_source_test: skipped, can't map %zu bytes\n", length);
+        return 0;
+    }
+    std::string_view source((const char *)memory, length);
+
+    CompiledSource compiled;
+    compiled.text = "left over\n";
+    if (CompileSource(source, compiled) || !compiled.text.empty()) {
+        std::printf("FAIL: CompileSource accepted a source over the limit\n");
+        failures++;
+    }
+    if (CompileSource(source, compiled, 4) || !compiled.text.empty()) {
+        std::printf("FAIL: the chunked CompileSource accepted a source over the limit\n");
+        failures++;
+    }
+
+    SimplePreprocessor preprocessor;
+    if (!preprocessor.Parse(source.data(), source.length()).empty()) {
+        std::printf("FAIL: Parse gave outputs for a source over the limit\n");
+        failures++;
+    }
+    if (!preprocessor.ParseParallel(source, 4).empty()) {
+        std::printf("FAIL: ParseParallel gave outputs for a source over the limit\n");
+        failures++;
+    }
+    munmap(memory, length);
+
+    // the limit itself isn't off by one: a source right at it has a text
+    // whose end still fits, newline included
+    static_assert(COMPILED_SOURCE_MAX_LENGTH + 1 <= UINT32_MAX);
+    std::vector<std::string> outputs = preprocessor.Parse(std::string("#if 1\nsmall\n#endif"));
+    if (outputs.size() != 1 || outputs[0] != "small\n") {
+        std::printf("FAIL: a small source doesn't parse anymore\n");
+        failures++;
+    }
+
+    if (failures == 0)
+        std::printf("large_source_test: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/******************************************************************************
+ *  Checks that the operations C++ leaves undefined give the same defined
+ *  result on every path, direct evaluation, compiled code, batches and
+ *  constant folding: out of range shift counts and divisions that don't fit
+ *  fail, +, -, * and negation of the extremes wrap around. Build it with the
+ *  undefined behavior sanitizer, for each operand type and dispatch:
+ *
+ *  g++ -std=c++20 -fsanitize=undefined -fno-sanitize-recover -I.. \
+ *      operator_edge_test.cpp ../arithmetic_parser.cpp
+ *  (again with -DPARSER_OPERAND_TYPE=int64_t, or -DPARSER_NO_COMPUTED_GOTO)
+ ******************************************************************************/
+
+#include "arithmetic_parser.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+static constexpr int BITS = sizeof(operand_t) * 8;
+static constexpr operand_t MIN = std::numeric_limits<operand_t>::min();
+static constexpr operand_t MAX = std::numeric_limits<operand_t>::max();
+
+static int failures = 0;
+
+// Evaluates "A op B" with A and B set to lhs and rhs on every path, expecting
+// either the value or a failure
+static void Check(const char *op, operand_t lhs, operand_t rhs, bool ok, operand_t value) {
+    std::string expr = std::string("A ") + op + " B";
+    std::string literal = std::to_string(lhs) + " " + op + " (" + std::to_string(rhs) + ")";
+    const char *path = nullptr;
+
+    // the literals can't spell the smallest value, it's negated from MAX
+    std::string direct = literal;
+    if (lhs == MIN && std::is_signed_v<operand_t>)
+        direct = "(-" + std::to_string(MAX) + " - 1) " + op + " (" + std::to_string(rhs) + ")";
+    std::pair<operand_t, bool> result = EvaluateExpression(direct);
+    if (result.second != ok || (ok && result.first != value))
+        path = "direct";
+
+    CompiledExpression compiled;
+    if (!path && !CompileExpression(expr, compiled))
+        path = "compile";
+    if (!path) {
+        operand_t values[2];
+        for (size_t i = 0; i < 2; i++)
+            values[i] = compiled.symbols[i] == "A" ? lhs : rhs;
+        result = EvaluateCompiled(compiled, values);
+        if (result.second != ok || (ok && result.first != value))
+            path = "compiled";
+    }
+
+    // every lane the same, but more than one block of them
+    if (!path) {
+        static constexpr size_t LANES = 70;
+        operand_t columns[2][LANES];
+        for (size_t i = 0; i < 2; i++)
+            for (size_t lane = 0; lane < LANES; lane++)
+                columns[i][lane] = compiled.symbols[i] == "A" ? lhs : rhs;
+        const operand_t *column_pointers[2] = {columns[0], columns[1]};
+        uint64_t bits[2], failed[2];
+        bool batch_ok = EvaluateCompiledBatch(compiled, column_pointers, LANES, bits, failed);
+        uint64_t expected_failed = ok ? 0 : ~uint64_t(0);
+        uint64_t expected_bits = ok && value != 0 ? ~uint64_t(0) : 0;
+        if (batch_ok != ok || failed[0] != expected_failed || bits[0] != expected_bits ||
+            failed[1] != (expected_failed & 0x3f) || bits[1] != (expected_bits & 0x3f))
+            path = "batch";
+    }
+
+    // folding both symbols: the constant, or the operation left in place
+    if (!path) {
+        std::unordered_map<std::string_view, operand_t> fixed{{"A", lhs}, {"B", rhs}};
+        CompiledExpression folded = PartialEvaluate(compiled, fixed);
+        if (ok ? !folded.IsConstant() || folded.code[0].constant != value : folded.IsConstant())
+            path = "folding";
+        else if (!ok && EvaluateCompiled(folded, nullptr).second)
+            path = "folded evaluation";
+    }
+
+    if (path) {
+        std::printf("FAIL: %s on the %s path\n", literal.c_str(), path);
+        failures++;
+    }
+}
+
+int main() {
+    // shift counts: 0 to width - 1 are fine, anything else fails
+    Check("<<", 1, 0, true, 1);
+    Check("<<", 1, BITS - 1, true, (operand_t)((std::make_unsigned_t<operand_t>)1 << (BITS - 1)));
+    Check(">>", MIN, BITS - 1, true, std::is_signed_v<operand_t> ? (operand_t)-1 : 0);
+    Check("<<", 1, BITS, false, 0);
+    Check(">>", 1, BITS, false, 0);
+    Check("<<", 1, 1000, false, 0);
+    Check("<<", 1, MAX, false, 0);
+    if constexpr (std::is_signed_v<operand_t>) {
+        Check("<<", 1, -1, false, 0);
+        Check(">>", 1, -1, false, 0);
+        Check(">>", -8, MIN, false, 0);
+    }
+
+    // divisions that fail stay failures
+    Check("/", 1, 0, false, 0);
+    Check("%", 1, 0, false, 0);
+    if constexpr (std::is_signed_v<operand_t>) {
+        Check("/", MIN, -1, false, 0);
+        Check("%", MIN, -1, false, 0);
+    }
+
+    // overflows wrap around
+    Check("+", MAX, 1, true, MIN);
+    Check("-", MIN, 1, true, MAX);
+    Check("*", MAX, 2, true, (operand_t)-2);
+    Check("*", MIN, -1, true, MIN);
+
+    // negation of the smallest value wraps to itself, whether it's evaluated
+    // directly, compiled or folded
+    if constexpr (std::is_signed_v<operand_t>) {
+        std::string literal = "-(-" + std::to_string(MAX) + " - 1) == -" + std::to_string(MAX) + " - 1";
+        std::pair<operand_t, bool> direct = EvaluateExpression(literal);
+        if (!direct.second || direct.first != 1) {
+            std::printf("FAIL: negation of the smallest value, direct\n");
+            failures++;
+        }
+        CompiledExpression compiled;
+        if (!CompileExpression("-A", compiled)) {
+            std::printf("FAIL: -A doesn't compile\n");
+            failures++;
+        } else {
+            operand_t value = MIN;
+            std::pair<operand_t, bool> result = EvaluateCompiled(compiled, &value);
+            const operand_t *column = &value;
+            uint64_t bits = 0;
+            CompiledExpression folded = PartialEvaluate(compiled, {{"A", MIN}});
+            if (!result.second || result.first != MIN ||
+                !EvaluateCompiledBatch(compiled, &column, 1, &bits) || bits != 1 ||
+                !folded.IsConstant() || folded.code[0].constant != MIN) {
+                std::printf("FAIL: negation of the smallest value, compiled\n");
+                failures++;
+            }
+        }
+    }
+
+    if (failures == 0)
+        std::printf("operator_edge_test: ok\n");
+    return failures == 0 ? 0 : 1;
+}
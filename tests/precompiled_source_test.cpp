@@ -0,0 +1,104 @@
+/******************************************************************************
+ *  Checks that precompiled sources are reproducible: the same source compiled
+ *  twice, with other work in between dirtying the heap and the stack, has to
+ *  serialize to the same bytes, whatever the padding of its records holds,
+ *  and load back.
+ *
+ *  g++ -std=c++20 -I.. precompiled_source_test.cpp ../precompiled_source.cpp \
+ *      ../simple_preprocessor.cpp ../arithmetic_parser.cpp
+ ******************************************************************************/
+
+#include "precompiled_source.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static const char *SOURCE =
+    "#if A + B * 2 > 4 && !C\n"
+    "text A B\n"
+    "#elif (D | 3) % 2 == ~E\n"
+    "#output 1\n"
+    "other D E\n"
+    "#else\n"
+    "#if -F\n"
+    "nested F\n"
+    "#endif\n"
+    "#endif\n"
+    "tail\n";
+
+static void DirtyMemory() {
+    // leave non-zero bytes where the next records are likely to be built
+    volatile char stack[1 << 14];
+    for (size_t i = 0; i < sizeof(stack); i++)
+        stack[i] = (char)(0xA5 ^ i);
+    for (int i = 0; i < 64; i++) {
+        std::string junk(64 + i * 32, (char)(0x5A + i));
+        std::memset(junk.data(), 0xC3, junk.length());
+    }
+}
+
+static std::string Serialize() {
+    CompiledSource source;
+    if (!CompileSource(SOURCE, source))
+        return {};
+    return SerializeCompiledSource(source);
+}
+
+int main() {
+    int failures = 0;
+
+    DirtyMemory();
+    std::string first = Serialize();
+    DirtyMemory();
+    std::string second = Serialize();
+    if (first.empty() || first != second) {
+        std::printf("FAIL: serializing the same source twice gave different bytes\n");
+        failures++;
+    }
+
+    // The same records with garbage in their padding and in the unused part
+    // of the operands, as if they had been built in uninitialized memory
+    CompiledSource source;
+    CompileSource(SOURCE, source);
+    CompiledSource dirty = source;
+    for (size_t i = 0; i < dirty.nodes.size(); i++) {
+        std::memset((void *)&dirty.nodes[i], 0xAB, sizeof(dirty.nodes[i]));
+        CompiledSource::Node& node = dirty.nodes[i];
+        CompiledSource::Node const& clean = source.nodes[i];
+        node.kind = clean.kind;
+        node.line = clean.line;
+        node.begin = clean.begin;
+        node.end = clean.end;
+        node.first_word = clean.first_word;
+        node.last_word = clean.last_word;
+        node.code_begin = clean.code_begin;
+        node.code_end = clean.code_end;
+        node.next = clean.next;
+        node.endif = clean.endif;
+    }
+    for (size_t i = 0; i < dirty.code.size(); i++) {
+        std::memset((void *)&dirty.code[i], 0xAB, sizeof(dirty.code[i]));
+        dirty.code[i].opcode = source.code[i].opcode;
+        if (source.code[i].opcode == EXPR_CONSTANT)
+            dirty.code[i].constant = source.code[i].constant;
+        else if (source.code[i].opcode == EXPR_SYMBOL)
+            dirty.code[i].symbol = source.code[i].symbol;
+    }
+    if (SerializeCompiledSource(dirty) != first) {
+        std::printf("FAIL: padding or unused operand bytes reached the serialized source\n");
+        failures++;
+    }
+
+    std::string copy(first);
+    CompiledSourceView view;
+    if (!LoadCompiledSource(copy, view) || view.nodes.size() != source.nodes.size() ||
+        view.code.size() != source.code.size()) {
+        std::printf("FAIL: the serialized source doesn't load back\n");
+        failures++;
+    }
+
+    if (failures == 0)
+        std::printf("precompiled_source_test: ok\n");
+    return failures == 0 ? 0 : 1;
+}
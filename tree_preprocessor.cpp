@@ -0,0 +1,232 @@
+/******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#include "tree_preprocessor.hpp"
+#include "batch_reader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+// The worker the current thread is, for Spawn
+static thread_local WorkStealingScheduler *current_scheduler = nullptr;
+static thread_local unsigned int current_worker = 0;
+
+WorkStealingScheduler::WorkStealingScheduler(unsigned int threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < threads; i++)
+        workers.push_back(std::make_unique<Worker>());
+}
+
+void WorkStealingScheduler::Spawn(Task task) {
+    Worker& worker = *workers[current_scheduler == this ? current_worker : 0];
+    pending.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(worker.mutex);
+    worker.tasks.push_back(std::move(task));
+}
+
+bool WorkStealingScheduler::PopOrSteal(unsigned int self, Task& task) {
+    {
+        Worker& own = *workers[self];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    // go around the others, starting next to us so thieves spread out
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(self + i) % workers.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingScheduler::WorkerLoop(unsigned int self) {
+    WorkStealingScheduler *previous_scheduler = current_scheduler;
+    unsigned int previous_worker = current_worker;
+    current_scheduler = this;
+    current_worker = self;
+
+    unsigned int idle = 0;
+    Task task;
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (!PopOrSteal(self, task)) {
+            // someone is still running a task that may spawn more
+            if (++idle < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            continue;
+        }
+        idle = 0;
+        task();
+        task = nullptr;
+        pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    current_scheduler = previous_scheduler;
+    current_worker = previous_worker;
+}
+
+void WorkStealingScheduler::Run(Task root) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(workers[0]->mutex);
+        workers[0]->tasks.push_back(std::move(root));
+    }
+
+    // the calling thread is worker 0
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < workers.size(); i++)
+        threads.emplace_back(&WorkStealingScheduler::WorkerLoop, this, i);
+    WorkerLoop(0);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+/******************************************************************************
+ *  Tree preprocessing
+ ******************************************************************************/
+
+struct TreeJob {
+    // a copy, so the whole tree is parsed with the defines of the moment the
+    // job starts, whatever Defines run meanwhile
+    SimplePreprocessor const preprocessor;
+    std::filesystem::path input_directory;
+    std::filesystem::path output_directory;
+    WorkStealingScheduler scheduler;
+
+    std::atomic<uint64_t> files {0};
+    std::atomic<uint64_t> failed {0};
+    std::atomic<uint64_t> errors {0};
+    std::atomic<uint64_t> bytes_in {0};
+    std::atomic<uint64_t> bytes_out {0};
+
+    TreeJob(SimplePreprocessor const& preprocessor, std::string const& input_directory,
+            std::string const& output_directory, unsigned int threads) :
+        preprocessor(preprocessor), input_directory(input_directory),
+        output_directory(output_directory), scheduler(threads) {}
+
+    void ListDirectory(std::filesystem::path directory);
+    void ReadFiles(std::vector<std::string> paths);
+    void ParseFile(std::filesystem::path path, std::shared_ptr<std::string> contents);
+    void WriteOutputs(std::filesystem::path path, std::shared_ptr<std::vector<std::string>> outputs);
+};
+
+// files of a directory read in one go
+static constexpr size_t READ_BATCH_SIZE = 256;
+
+void TreeJob::ListDirectory(std::filesystem::path directory) {
+    std::error_code error;
+    std::vector<std::string> batch;
+    // the range-for would increment with the throwing overload, a directory
+    // that can't be read any further only ends its listing
+    std::filesystem::directory_iterator it(directory, error);
+    for (; !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+        std::filesystem::directory_entry const& entry = *it;
+        std::error_code entry_error;
+        if (entry.is_directory(entry_error)) {
+            scheduler.Spawn([this, path = entry.path()] { ListDirectory(path); });
+        } else if (entry.is_regular_file(entry_error)) {
+            batch.push_back(entry.path().string());
+            if (batch.size() == READ_BATCH_SIZE) {
+                scheduler.Spawn([this, paths = std::move(batch)] { ReadFiles(paths); });
+                batch.clear();
+            }
+        } else if (entry_error) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (error)
+        errors.fetch_add(1, std::memory_order_relaxed);
+    if (!batch.empty())
+        scheduler.Spawn([this, paths = std::move(batch)] { ReadFiles(paths); });
+}
+
+void TreeJob::ReadFiles(std::vector<std::string> paths) {
+    // every worker keeps its reader (and its io_uring) for the next batches
+    static thread_local BatchFileReader reader;
+    reader.Read(paths, [&](size_t index, std::string *contents) {
+        if (contents == nullptr) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        bytes_in.fetch_add(contents->length(), std::memory_order_relaxed);
+        // the other workers parse while this one keeps reading
+        scheduler.Spawn([this, path = std::filesystem::path(paths[index]),
+                         contents = std::make_shared<std::string>(std::move(*contents))] {
+            ParseFile(path, contents);
+        });
+    });
+}
+
+void TreeJob::ParseFile(std::filesystem::path path, std::shared_ptr<std::string> contents) {
+    auto outputs = std::make_shared<std::vector<std::string>>(preprocessor.Parse(*contents));
+    contents.reset();
+    if (outputs->empty()) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    scheduler.Spawn([this, path = std::move(path), outputs] { WriteOutputs(path, outputs); });
+}
+
+void TreeJob::WriteOutputs(std::filesystem::path path, std::shared_ptr<std::vector<std::string>> outputs) {
+    std::filesystem::path target = output_directory / path.lexically_relative(input_directory);
+    std::error_code error;
+    // output N of name is name.N, which is also where an input file name.N
+    // goes: rather than have one overwrite the other, neither output of name
+    // is written
+    for (size_t i = 1; i < outputs->size(); i++) {
+        std::filesystem::path sibling = path;
+        sibling += "." + std::to_string(i);
+        if (std::filesystem::exists(sibling, error)) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    std::filesystem::create_directories(target.parent_path(), error);
+
+    for (size_t i = 0; i < outputs->size(); i++) {
+        std::filesystem::path output_path = target;
+        if (i > 0)
+            output_path += "." + std::to_string(i);
+        std::ofstream file(output_path, std::ios::binary | std::ios::trunc);
+        file.write((*outputs)[i].data(), (*outputs)[i].length());
+        if (!file) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        bytes_out.fetch_add((*outputs)[i].length(), std::memory_order_relaxed);
+    }
+    files.fetch_add(1, std::memory_order_relaxed);
+}
+
+TreeStats PreprocessTree(SimplePreprocessor const& preprocessor, std::string const& input_directory,
+                         std::string const& output_directory, unsigned int threads) {
+    TreeJob job(preprocessor, input_directory, output_directory, threads);
+    job.scheduler.Run([&job] { job.ListDirectory(job.input_directory); });
+
+    return { job.files.load(), job.failed.load(), job.errors.load(),
+             job.bytes_in.load(), job.bytes_out.load() };
+}
@@ -0,0 +1,90 @@
+/******************************************************************************
+ *  Directory tree preprocessing
+ *
+ *  PreprocessTree runs every file under a directory through a preprocessor
+ *  and writes the outputs under another directory, with the same relative
+ *  paths. Output 0 of a file keeps its name, output N gets ".N" appended.
+ *  Every file is parsed with the defines of the moment PreprocessTree is
+ *  called. Files that fail to parse are counted and nothing is written for
+ *  them. Nor is anything written for a file with more outputs whose ".N"
+ *  name is taken by another input file, that's an error.
+ *
+ *  The work is split into tasks (listing a directory, reading a file, parsing
+ *  it, writing its outputs) that run on a WorkStealingScheduler: every worker
+ *  has its own deque, pushes and pops the tasks it spawns at the back (the
+ *  most recent, still warm work) and, once it runs out, steals from the front
+ *  of the others (the oldest tasks, which tend to be whole directories). A
+ *  few huge files keep their workers busy while everyone else drains the rest
+ *  of the tree.
+ *
+ *  The files of a directory are read in batches through a BatchFileReader
+ *  (io_uring where available), each file handed to a parse task as soon as
+ *  it's in, so the syscalls of many small files don't hold the workers up.
+ *
+ ******************************************************************************
+ *  License:
+ *  This software is available as a choice of the following licenses. Choose
+ *  whichever one you prefer.
+ *
+ *  Alternative 1 - Public Domain
+ *  This is free and unencumbered software released into the public domain.
+ *  For a copy, see <www.unlicense.org>
+ *
+ *  Alternative 2 - MIT license.
+ *  Copyright (c) 2024 Constantitus
+ *  For a copy, see <https://opensource.org/licenses/MIT>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "simple_preprocessor.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class WorkStealingScheduler {
+public:
+    using Task = std::function<void()>;
+
+    // 0 threads uses one per hardware thread
+    explicit WorkStealingScheduler(unsigned int threads = 0);
+
+    // Runs root on the calling thread and the workers, along with everything
+    // it spawns, and returns once all of it is done
+    void Run(Task root);
+
+    // Queues a task on the deque of the calling worker. Only valid from inside
+    // a task of this scheduler.
+    void Spawn(Task task);
+
+    unsigned int ThreadCount() const { return (unsigned int)workers.size(); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool PopOrSteal(unsigned int self, Task& task);
+    void WorkerLoop(unsigned int self);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<uint64_t> pending {0}; // spawned and not finished yet
+};
+
+struct TreeStats {
+    uint64_t files;         // preprocessed
+    uint64_t failed;        // didn't parse
+    uint64_t errors;        // couldn't be read or written
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+TreeStats PreprocessTree(SimplePreprocessor const& preprocessor, std::string const& input_directory,
+                         std::string const& output_directory, unsigned int threads = 0);